@@ -0,0 +1,174 @@
+/*
+ * SI5351 driver benchmark.
+ *
+ * Copyright (c) David Knell 2024.
+ * Licensed under the CC-BY-NC 4.0 license - text at https://creativecommons.org/licenses/by-nc/4.0/legalcode.en
+ * For all enquiries, please contact the author at david.knell@gmail.com
+ *
+ * Runs the driver on the host against a mock bus which counts transactions and bytes, and
+ * reports the CPU time and bus traffic of the common operations.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+// Pull the driver in directly so the static helpers can be timed too
+#include "../src/si5351.c"
+
+#define BENCH_RUNS (1000)
+
+// What went over the mock bus
+typedef struct {
+    unsigned long transactions;
+    unsigned long bytes;          // Register address and data bytes, not the device address
+} bench_bus_t;
+
+static bench_bus_t bus;
+
+static int bench_write(void *dev, uint8_t reg, uint8_t val)
+{
+    (void) dev;
+    (void) reg;
+    (void) val;
+    bus.transactions++;
+    bus.bytes += 2;
+    return 0;
+}
+
+static int bench_write_block(void *dev, uint8_t reg, const uint8_t *buf, size_t len)
+{
+    (void) dev;
+    (void) reg;
+    (void) buf;
+    bus.transactions++;
+    bus.bytes += 1 + len;
+    return 0;
+}
+
+static double bench_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1e6) + (ts.tv_nsec / 1e3);
+}
+
+// Time on an I2C bus - each byte is 9 clocks with its ACK, plus the device address byte and
+// roughly 2 clocks for the start and stop conditions per transaction
+static double bench_bus_us(const bench_bus_t *b, unsigned long hz)
+{
+    double clocks = ((b->bytes + b->transactions) * 9.0) + (b->transactions * 2.0);
+    return clocks * 1e6 / hz;
+}
+
+static void bench_report(const char *name, double cpu_us, const bench_bus_t *b)
+{
+    printf("%-24s %10.2f %8.1f %8.1f %9.1f %9.1f %9.1f\n", name, cpu_us,
+        (double) b->transactions / BENCH_RUNS, (double) b->bytes / BENCH_RUNS,
+        bench_bus_us(b, 100000) / BENCH_RUNS, bench_bus_us(b, 400000) / BENCH_RUNS, bench_bus_us(b, 1000000) / BENCH_RUNS);
+}
+
+static void bench_setup(si5351_t *si5351, bool block)
+{
+    si5351_init(si5351, NULL, SI5351_CRYSTAL_FREQ_25MHZ, SI5351_CRYSTAL_LOAD_10PF, SI5351_VARIANT_A_20, bench_write, NULL);
+    if (block) {
+        si5351_set_write_block(si5351, bench_write_block);
+    }
+    si5351_start_batch(si5351);
+    si5351_set(si5351, 0, SI5351_PLL_A, 10000000, 0, false, true);
+    si5351_set(si5351, 1, SI5351_PLL_A, 7040000, 0, false, false);
+    si5351_set(si5351, 2, SI5351_PLL_B, 14318180, 0, false, true);
+    si5351_write_batch(si5351);
+}
+
+static void bench_run(bool block)
+{
+    si5351_t si5351;
+    double start;
+
+    printf("\n%s writes\n", block ? "Block" : "Single register");
+    printf("%-24s %10s %8s %8s %9s %9s %9s\n", "Scenario", "CPU us", "Txns", "Bytes", "100kHz us", "400kHz us", "1MHz us");
+
+    // Cold init - everything from reset to three running outputs
+    bus = (bench_bus_t) {0};
+    start = bench_now_us();
+    for (int i=0; i<BENCH_RUNS; i++) {
+        bench_setup(&si5351, block);
+    }
+    bench_report("Cold init", (bench_now_us() - start) / BENCH_RUNS, &bus);
+
+    // Retune a single output from its PLL's current VCO
+    bench_setup(&si5351, block);
+    bus = (bench_bus_t) {0};
+    start = bench_now_us();
+    for (int i=0; i<BENCH_RUNS; i++) {
+        si5351_retune(&si5351, 1, 7000000 + (i % 100) * 1000);
+    }
+    bench_report("Single output retune", (bench_now_us() - start) / BENCH_RUNS, &bus);
+
+    // Move the master output, so the whole PLL is reprogrammed
+    bus = (bench_bus_t) {0};
+    start = bench_now_us();
+    for (int i=0; i<BENCH_RUNS; i++) {
+        si5351_set(&si5351, 0, SI5351_PLL_A, 10000000 + (i % 100) * 12345, 0, false, true);
+    }
+    bench_report("PLL change", (bench_now_us() - start) / BENCH_RUNS, &bus);
+
+    // Full recompute with nothing to send
+    bus = (bench_bus_t) {0};
+    start = bench_now_us();
+    for (int i=0; i<BENCH_RUNS; i++) {
+        si5351.changed = SI5351_CHANGED_CONFIG;
+        si5351_configure(&si5351);
+    }
+    bench_report("Configure, no change", (bench_now_us() - start) / BENCH_RUNS, &bus);
+
+    // The same with the multisynth solutions cached
+    si5351_cache_t cache;
+    si5351_cache_init(&cache);
+    si5351_set_cache(&si5351, &cache);
+    bus = (bench_bus_t) {0};
+    start = bench_now_us();
+    for (int i=0; i<BENCH_RUNS; i++) {
+        si5351.changed = SI5351_CHANGED_CONFIG;
+        si5351_configure(&si5351);
+    }
+    bench_report("Configure, cached", (bench_now_us() - start) / BENCH_RUNS, &bus);
+    si5351_set_cache(&si5351, NULL);
+
+    // Hop between precomputed channels
+    uint32_t freqs[100];
+    si5351_hop_t table[100];
+    for (int i=0; i<100; i++) {
+        freqs[i] = 7000000 + i * 1000;
+    }
+    bus = (bench_bus_t) {0};
+    start = bench_now_us();
+    si5351_hop_build(&si5351, 1, 0, freqs, 100, table);
+    double build_us = bench_now_us() - start;
+    start = bench_now_us();
+    for (int i=0; i<BENCH_RUNS; i++) {
+        si5351_hop(&si5351, 1, table, i % 100);
+    }
+    bench_report("Hop", (bench_now_us() - start) / BENCH_RUNS, &bus);
+    printf("%-24s %10.2f\n", "Hop table build, 100", build_us);
+}
+
+int main(void)
+{
+    // The fraction search on its own, over a spread of awkward ratios
+    uint32_t num, den;
+    uint32_t sink = 0;
+    double start = bench_now_us();
+    for (int i=0; i<BENCH_RUNS; i++) {
+        uint64_t q = 25000000;
+        uint64_t p = (7919ULL * (i + 1) * 104729ULL) % q;
+        farey_fraction(p, q, 1048575, &num, &den);
+        sink += num + den;
+    }
+    printf("farey_fraction: %.3f us per call (%u)\n", (bench_now_us() - start) / BENCH_RUNS, sink & 1);
+
+    bench_run(false);
+    bench_run(true);
+
+    return 0;
+}
@@ -8,16 +8,51 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define SI5351_CLOCKS (8)
+#define SI5351_CLOCKS_A_10 (3)              // Outputs on the 10-pin Si5351A
 #define SI5351_PLLS (2)
 #define SI5351_MIN_FREQ (8000)
 #define SI5351_MAX_FREQ (150000000)
 #define SI5351_VCO_MIN (600000000)
 #define SI5351_VCO_MAX (900000000)
 #define SI5351_CLOCK_ALL (-1)
+#define SI5351_REGISTERS (184)
+#define SI5351_MS_REGS (8)
+#define SI5351_TX_MAX (40)
+#define SI5351_QUEUE_LEN (8)                // Must be a power of two
+#define SI5351_GROUP_MAX (4)
+#define SI5351_WRITE_RETRIES (2)            // Default for si5351_set_retries()
+#ifndef SI5351_CACHE_LEN
+#define SI5351_CACHE_LEN (8)                // Entries in a multisynth cache
+#endif
+
+// Fixed point frequencies for si5351_set_freq_q() are in Hz * 2^SI5351_FREQ_SHIFT
+#define SI5351_FREQ_SHIFT (16)
+#define SI5351_FREQ_Q(hz) ((uint64_t) (hz) << SI5351_FREQ_SHIFT)
+
+// Largest output phase offset, in quarter VCO periods
+#define SI5351_PHASE_MAX (127)
+
+// Spread spectrum limits, in units of 0.01%
+#define SI5351_SPREAD_MIN (10)
+#define SI5351_SPREAD_DOWN_MAX (250)
+#define SI5351_SPREAD_CENTER_MAX (150)
+
+// Largest crystal correction, in parts per billion
+#define SI5351_CORRECTION_MAX (1000000)
+
+// Values for SI5351_LOG_LEVEL, which sets which driver log messages are compiled in
+#define SI5351_LOG_NONE (0)
+#define SI5351_LOG_ERROR (1)
+#define SI5351_LOG_DEBUG (2)
 
 
 // Register layout
@@ -33,10 +68,28 @@ enum {
   SI5351_REG_CLK7_4_DISABLE_STATE = 25,
   SI5351_REG_MSN_PLL_BASE = 26,
   SI5351_REG_CLK_SYNTH_BASE = 42,
+  SI5351_REG_MS6_P1 = 90,
+  SI5351_REG_MS7_P1 = 91,
+  SI5351_REG_CLK6_7_R_DIV = 92,
+  SI5351_REG_SSC_BASE = 149,
   SI5351_REG_PHASE_BASE = 165,
+  SI5351_REG_PLL_RESET = 177,
   SI5351_REG_CRYSTAL_INTERNAL_LOAD_CAPACITANCE = 183
 };
 
+// Device status and interrupt bits - registers 0, 1 and 2
+#define SI5351_STATUS_SYS_INIT (0x80)
+#define SI5351_STATUS_LOL_B (0x40)
+#define SI5351_STATUS_LOL_A (0x20)
+#define SI5351_STATUS_LOS (0x10)
+
+// Poll interval for si5351_wait_lock()
+#define SI5351_LOCK_POLL_US (100)
+
+// PLL soft reset bits
+#define SI5351_PLL_RESET_A (0x20)
+#define SI5351_PLL_RESET_B (0x80)
+
 typedef enum {
   SI5351_DISABLE_LOW = 0,
   SI5351_DISABLE_HIGH,
@@ -60,6 +113,20 @@ typedef enum {
   SI5351_CRYSTAL_FREQ_27MHZ = (27000000)
 } si5351_crystal_frequency_t;
 
+// Which part the driver is talking to.  The Si5351B's VCXO and the Si5351C's CLKIN aren't
+// supported - both PLLs run from the crystal as on the Si5351A.
+typedef enum {
+  SI5351_VARIANT_A_20 = 0,                  // Si5351A, 20-pin QFN or 24-pin QSOP - CLK0-7
+  SI5351_VARIANT_A_10,                      // Si5351A, 10-pin MSOP - CLK0-2 only
+  SI5351_VARIANT_B,                         // Si5351B - CLK0-7
+  SI5351_VARIANT_C,                         // Si5351C - CLK0-7
+} si5351_variant_t;
+
+typedef enum {
+  SI5351_SPREAD_DOWN = 0,
+  SI5351_SPREAD_CENTER
+} si5351_spread_t;
+
 typedef enum {
   SI5351_CLK_DRV_2MA = 0,
   SI5351_CLK_DRV_4MA = 1,
@@ -67,26 +134,230 @@ typedef enum {
   SI5351_CLK_DRV_8MA = 3
 } si5351_clock_drive_t;
 
-typedef struct si5351_t {
-  void *dev;
+// Precomputed output multisynth registers for one channel of a hop table
+typedef struct {
+  uint32_t freq;
+  uint32_t vco_freq;                        // VCO frequency the registers were worked out for
+  uint8_t control;                          // CLKx_CONTROL for this channel
+  uint8_t reg[SI5351_MS_REGS];
+} si5351_hop_t;
+
+// A frequency sweep on one output, set up by si5351_sweep_init()
+typedef struct {
+  uint8_t output;
+  uint32_t vco_freq;                        // VCO frequency the sweep runs from
+  uint32_t freq;                            // Next point
+  uint32_t stop;
+  uint32_t step;
+  uint32_t dwell_us;                        // Time on each point for si5351_sweep_run()
+  bool done;
+} si5351_sweep_t;
+
+// Complete register image for a configuration, filled in by si5351_compute()
+typedef struct {
+  uint8_t reg[SI5351_REGISTERS];
+  uint8_t used[(SI5351_REGISTERS + 7) / 8];  // Which registers are part of this image
+  uint32_t vco_freq[SI5351_PLLS];           // VCO frequencies it was calculated for
+  uint8_t fb_int;                           // PLLs whose feedback multisynth is in integer mode
+  uint8_t ms_int;                           // Outputs whose multisynth is in integer mode
+} si5351_regmap_t;
+
+// One run of consecutive registers in an asynchronous transaction list
+typedef struct {
+  uint8_t reg;
+  uint8_t len;
+  const uint8_t *data;
+} si5351_tx_t;
+
+// Caller-owned buffer which si5351_write_batch_async() builds its register writes in
+typedef struct {
+  si5351_tx_t tx[SI5351_TX_MAX];
+  uint8_t data[SI5351_REGISTERS + 8];
+  size_t count;
+  size_t used;
+  bool overflow;
+} si5351_txlist_t;
+
+// A retune posted with si5351_post_retune()
+typedef struct {
+  uint8_t output;
+  uint32_t freq;
+} si5351_cmd_t;
+
+// Points in a configuration passed to si5351_stats_t.event
+typedef enum {
+  SI5351_EVENT_COMPUTE_START = 0,
+  SI5351_EVENT_COMPUTE_END,
+  SI5351_EVENT_APPLY_START,
+  SI5351_EVENT_APPLY_END,
+} si5351_event_t;
+
+// Driver counters - see si5351_set_stats()
+typedef struct {
+  uint32_t configures;                      // Configurations which had something to send
+  uint32_t computes;                        // Full register images worked out
+  uint32_t transactions;                    // Bus writes, of a single register or a block
+  uint32_t bytes;                           // Register values written
+  uint32_t write_errors;                    // Writes and asynchronous transfers which failed
+  uint32_t farey_iterations;                // Steps of the fraction search
+  uint32_t cache_hits;                      // Fraction searches skipped by the multisynth cache
+  void (*event)(void *arg, si5351_event_t event);  // Optional - for timestamping compute and apply
+  void *event_arg;
+} si5351_stats_t;
+
+// A multisynth solution - the divider f1 / f2 as packed parameters
+typedef struct {
+  uint64_t f1;
+  uint64_t f2;
+  uint32_t pll[3];
+  bool integer;                             // Even integer, so integer mode can be used
+} si5351_cache_entry_t;
+
+// Recently used multisynth solutions, most recent first - see si5351_set_cache()
+typedef struct {
+  si5351_cache_entry_t entry[SI5351_CACHE_LEN];
+  uint8_t count;
+  uint32_t hits;
+  uint32_t misses;
+} si5351_cache_t;
+
+struct si5351_t;
+typedef void (*si5351_done_t)(struct si5351_t *si5351, int status, void *arg);
+typedef int (*si5351_submit_t)(void *dev, const si5351_tx_t *tx, size_t count, void (*complete)(void *ctx, int status), void *ctx);
+
+// The parts of a driver instance which are fixed once it's set up.  These can be shared
+// between instances and kept in flash - see si5351_init_desc().
+typedef struct {
   uint32_t crystal_freq;
   si5351_crystal_load_t crystal_load;
+  int (*write)(void *dev, uint8_t reg, uint8_t val);
+  int (*write_block)(void *dev, uint8_t reg, const uint8_t *buf, size_t len);  // Optional auto-increment write
+  int (*read)(void *dev, uint8_t reg, uint8_t *val);  // Optional register read
+  void (*log)(const char *fmt, ...);        // Optional
+  si5351_submit_t submit;                   // Optional asynchronous transfer of a transaction list
+  si5351_variant_t variant;                 // Which part - sets which outputs there are
+} si5351_desc_t;
+
+// Per-output settings, packed into two bytes
+typedef struct {
+  uint8_t pll : 1;                          // Which PLL we use to derive this clock frequency - si5351_PLL_t
+  uint8_t invert : 1;                       // Invert clock output
+  uint8_t drive : 2;                        // Clock drive current - si5351_clock_drive_t
+  uint8_t disable : 2;                      // Output state when disabled - si5351_disable_t
+  uint8_t phase;                            // Clock phase, in quarter VCO periods
+} si5351_clock_t;
+
+typedef struct si5351_t {
+  void *dev;
+  const si5351_desc_t *desc;
+#ifndef SI5351_CONST_DESC
+  si5351_desc_t own_desc;                   // Used by si5351_init() and the callback setters
+#endif
+  int32_t crystal_ppb;                      // Crystal error in parts per billion, positive if the crystal runs fast
+  uint16_t spread;                          // PLL A spread spectrum in 0.01% units, or 0 for off
+  bool spread_center;                       // Center rather than down spread
   uint32_t freq[SI5351_CLOCKS];             // Clock frequency
-  uint32_t phase[SI5351_CLOCKS];            // Clock phase
-  si5351_PLL_t pll[SI5351_CLOCKS];           // Which PLL we use to derive this clock frequency
+  uint16_t freq_frac[SI5351_CLOCKS];        // Fractional part of the frequency, in 1/2^16ths of a Hz
+  si5351_clock_t clk[SI5351_CLOCKS];
   uint8_t clk_pll[SI5351_PLLS];             // Which of the output clocks we use to derive this PLL frequency
-  si5351_disable_t clk_dis[SI5351_CLOCKS];  // Output state when disabled
-  uint8_t clk_invert[SI5351_CLOCKS];        // Invert clock output
-  si5351_clock_drive_t clk_drive[SI5351_CLOCKS];  // Clock drive current
   uint32_t vco_freq[SI5351_PLLS];           // Calculated VCO frequency
+  uint32_t vco_fixed[SI5351_PLLS];          // Fixed VCO frequency, or 0 to derive it from clk_pll
+  uint8_t fb_int;                           // PLLs whose feedback multisynth is in integer mode
+  uint8_t ms_int;                           // Outputs whose multisynth is in integer mode
+  uint8_t reset_pll;                        // PLL reset bits to send at the next configure regardless
+  uint8_t retries;                          // Extra attempts at a failed write
+  uint8_t shadow[SI5351_REGISTERS];         // Last value written to each register
+  uint8_t shadow_valid[(SI5351_REGISTERS + 7) / 8];  // Which shadow entries are known to match the chip
   bool config;
-  int (*write)(void *dev, uint8_t reg, uint8_t val);
-  void (*log)(const char *fmt, ...);
+  uint8_t changed;                          // What needs sending at the next configure
+  uint8_t staged;                           // Outputs retuned during a batch, waiting to be sent
+  uint8_t staged_int;                       // Which of them are in integer mode
+  uint8_t staged_reg[SI5351_CLOCKS][SI5351_MS_REGS];  // Their multisynth registers - CLK6/7 divider and R divider
+  bool glitch_free;                         // Only disable outputs affected by a change
+  si5351_txlist_t *pending;                 // Transaction list currently being sent
+  bool armed;                               // The pending list is waiting for si5351_fire()
+  si5351_done_t pending_done;
+  void *pending_arg;
+  void (*lock)(void *arg);                  // Optional lock for access from more than one task
+  void (*unlock)(void *arg);
+  void *lock_arg;
+  si5351_cache_t *cache;                    // Optional multisynth solution cache
+  si5351_stats_t *stats;                    // Optional counters
+  si5351_cmd_t queue[SI5351_QUEUE_LEN];     // Retunes posted by si5351_post_retune()
+  uint8_t queue_head;                       // Next entry to process - only written by the consumer
+  uint8_t queue_tail;                       // Next free entry - only written by the producer
 } si5351_t;
 
-void si5351_init(si5351_t *si5351, void *dev, uint32_t crystalFreq, si5351_crystal_load_t crystalLoad, 
+// Several devices, usually on one bus, which are reprogrammed together
+typedef struct {
+  si5351_t *member[SI5351_GROUP_MAX];
+  size_t count;
+  void *bus;                                // Passed to begin and end
+  int (*begin)(void *bus);                  // Optional - start a bus session
+  void (*end)(void *bus);                   // Optional - end it
+} si5351_group_t;
+
+void si5351_init_desc(si5351_t *si5351, void *dev, const si5351_desc_t *desc);
+void si5351_init_warm(si5351_t *si5351, void *dev, const si5351_desc_t *desc);
+#ifndef SI5351_CONST_DESC
+void si5351_init(si5351_t *si5351, void *dev, uint32_t crystalFreq, si5351_crystal_load_t crystalLoad, si5351_variant_t variant,
                   int (*write)(void *dev, uint8_t reg, uint8_t val), void (*log)(const char *fmt, ...));
+#endif
 int si5351_set(si5351_t *si5351, uint8_t
  output, si5351_PLL_t pll, uint32_t freq, uint32_t phase, bool invert, bool pll_master);
+int si5351_set_quadrature(si5351_t *si5351, uint8_t out_i, uint8_t out_q, si5351_PLL_t pll, uint32_t freq, uint16_t degrees);
+int si5351_set_freq_q(si5351_t *si5351, uint8_t output, uint64_t freq_q, uint64_t *actual_q, int64_t *error_q);
+int si5351_set_correction(si5351_t *si5351, int32_t ppb);
+int si5351_set_spread(si5351_t *si5351, si5351_spread_t mode, uint16_t amount);
+int si5351_get_freq(const si5351_t *si5351, uint8_t output, uint64_t *actual_q, int32_t *error_ppb);
+int si5351_compute(const si5351_t *si5351, si5351_regmap_t *map);
+int si5351_apply(si5351_t *si5351, const si5351_regmap_t *map);
+int si5351_retune(si5351_t *si5351, uint8_t output, uint32_t freq);
+int si5351_sweep_init(si5351_t *si5351, si5351_sweep_t *sweep, uint8_t output, uint32_t start, uint32_t stop, uint32_t step, uint32_t dwell_us);
+int si5351_sweep_step(si5351_t *si5351, si5351_sweep_t *sweep);
+int si5351_sweep_run(si5351_t *si5351, si5351_sweep_t *sweep, int (*wait)(void *dev, uint32_t us));
+int si5351_sweep_fill(si5351_t *si5351, si5351_sweep_t *sweep, si5351_hop_t *table, size_t count);
+int si5351_set_vco(si5351_t *si5351, si5351_PLL_t pll, uint32_t vco_freq);
+int si5351_plan(si5351_t *si5351, const uint32_t *freq);
+void si5351_start_batch(si5351_t *si5351);
+int si5351_write_batch(si5351_t *si5351);
+int si5351_signature(const si5351_t *si5351, uint32_t *signature);
+int si5351_warm_boot(si5351_t *si5351, uint32_t signature);
+int si5351_set_disabled(si5351_t *si5351, int clock, si5351_disable_t ds);
+int si5351_set_drive(si5351_t *si5351, int clock, si5351_clock_drive_t drive);
+int si5351_hop_build(si5351_t *si5351, uint8_t output, uint32_t vco_freq, const uint32_t *freqs, size_t count, si5351_hop_t *table);
+int si5351_hop(si5351_t *si5351, uint8_t output, const si5351_hop_t *table, size_t index);
+void si5351_get_integer_mode(const si5351_t *si5351, uint8_t *fb_int, uint8_t *ms_int);
+void si5351_set_glitch_free(si5351_t *si5351, bool glitch_free);
+#ifndef SI5351_CONST_DESC
+void si5351_set_write_block(si5351_t *si5351, int (*write_block)(void *dev, uint8_t reg, const uint8_t *buf, size_t len));
+#endif
+int si5351_load_image(si5351_t *si5351, const uint8_t *image, size_t len);
+#ifndef SI5351_CONST_DESC
+void si5351_set_read(si5351_t *si5351, int (*read)(void *dev, uint8_t reg, uint8_t *val));
+#endif
+int si5351_read_status(si5351_t *si5351, uint8_t *status);
+int si5351_set_interrupt_mask(si5351_t *si5351, uint8_t mask);
+int si5351_wait_lock(si5351_t *si5351, uint8_t plls, uint32_t timeout_us, int (*wait)(void *dev, uint32_t us));
+#ifndef SI5351_CONST_DESC
+void si5351_set_submit(si5351_t *si5351, si5351_submit_t submit);
+#endif
+int si5351_write_batch_async(si5351_t *si5351, si5351_txlist_t *list, si5351_done_t done, void *arg);
+int si5351_schedule(si5351_t *si5351, si5351_txlist_t *list, si5351_done_t done, void *arg);
+int si5351_fire(si5351_t *si5351);
+void si5351_unschedule(si5351_t *si5351);
+void si5351_set_lock(si5351_t *si5351, void (*lock)(void *arg), void (*unlock)(void *arg), void *arg);
+void si5351_cache_init(si5351_cache_t *cache);
+void si5351_set_cache(si5351_t *si5351, si5351_cache_t *cache);
+void si5351_set_retries(si5351_t *si5351, uint8_t retries);
+void si5351_set_stats(si5351_t *si5351, si5351_stats_t *stats);
+int si5351_post_retune(si5351_t *si5351, uint8_t output, uint32_t freq);
+int si5351_process_queue(si5351_t *si5351);
+void si5351_group_init(si5351_group_t *group, void *bus, int (*begin)(void *bus), void (*end)(void *bus));
+int si5351_group_add(si5351_group_t *group, si5351_t *si5351);
+void si5351_group_start(si5351_group_t *group);
+int si5351_group_write(si5351_group_t *group, bool sync_reset);
 
-
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,420 @@
+/*
+ * SI5351 driver - compile-time register images for fixed clock plans.
+ *
+ * Copyright (c) David Knell 2024.
+ * Licensed under the CC-BY-NC 4.0 license - text at https://creativecommons.org/licenses/by-nc/4.0/legalcode.en
+ * For all enquiries, please contact the author at david.knell@gmail.com
+ */
+
+/*
+ * Boards which always run the same clock plan can have the whole register image worked out
+ * by the compiler, using exactly the same calculation as si5351_configure():
+ *
+ *   static constexpr si5351::config plan = {
+ *     SI5351_CRYSTAL_FREQ_27MHZ, SI5351_CRYSTAL_LOAD_8PF, {
+ *       { 2000000, SI5351_PLL_A, true },
+ *       { 2000000, SI5351_PLL_A, false, true },
+ *     }
+ *   };
+ *   static constexpr auto image = si5351::build<plan>();
+ *
+ *   si5351::load<plan>(&si5351, image);
+ *
+ * An invalid plan fails to compile, with an error pointing at invalid_configuration().
+ * Requires C++14.
+ */
+
+#pragma once
+
+#include "si5351.h"
+
+namespace si5351 {
+
+struct clock_config {
+  uint32_t freq;                    // Clock frequency, 0 if unused
+  si5351_PLL_t pll;                 // Which PLL we use to derive this clock frequency
+  bool pll_master;                  // Whether this clock is used to derive the PLL frequency
+  bool invert;                      // Invert clock output
+  uint8_t phase;                    // Clock phase
+  si5351_clock_drive_t drive;       // Clock drive current
+  si5351_disable_t disable;         // Output state when disabled
+};
+
+struct config {
+  uint32_t crystal_freq;
+  si5351_crystal_load_t crystal_load;
+  clock_config clock[SI5351_CLOCKS];
+  si5351_variant_t variant;         // Which part - the Si5351A-20 if left out
+};
+
+// Register image in the form taken by si5351_load_image(), and the plan it was built from
+struct config;
+template <size_t N, const config *C = nullptr>
+struct image {
+  uint8_t data[N];
+  static constexpr size_t size = N;
+};
+
+// Deliberately not constexpr - reaching this while building an image stops compilation
+inline void invalid_configuration(const char *) {}
+
+namespace detail {
+
+struct regmap {
+  uint8_t reg[SI5351_REGISTERS];
+  bool used[SI5351_REGISTERS];
+  uint32_t vco_freq[SI5351_PLLS];
+  uint8_t fb_int;
+  uint8_t ms_int;
+};
+
+constexpr void set(regmap &map, int reg, uint8_t val)
+{
+  map.reg[reg] = val;
+  map.used[reg] = true;
+}
+
+// Same continued fraction search as farey_fraction() in si5351.c
+constexpr void farey_fraction(uint64_t p, uint64_t q, uint32_t max_denominator, uint32_t &num, uint32_t &den)
+{
+  num = 0;
+  den = 1;
+  if ((p == 0) || (p >= q) || (max_denominator <= 1)) return;
+
+  uint64_t p0 = 0, q0 = 1, p1 = 1, q1 = 0;
+  uint64_t n = p, d = q;
+  while (d != 0) {
+    uint64_t a = n / d;
+    uint64_t q2 = q0 + a * q1;
+    if (q2 > max_denominator) break;
+    uint64_t p2 = p0 + a * p1;
+    p0 = p1;
+    q0 = q1;
+    p1 = p2;
+    q1 = q2;
+    uint64_t r = n - a * d;
+    n = d;
+    d = r;
+  }
+
+  num = p1;
+  den = q1;
+  if (d != 0) {
+    uint64_t k = (max_denominator - q0) / q1;
+    uint64_t sq = q0 + k * q1;
+    if ((n - k * d) * q1 < d * sq) {
+      num = p0 + k * p1;
+      den = sq;
+    }
+  }
+}
+
+// Returns true if the ratio is an even integer, so the multisynth can run in integer mode
+constexpr bool multisynth(regmap &map, int base, uint64_t f1, uint64_t f2, uint8_t r_div)
+{
+  uint32_t mult = f1 / f2;
+  uint32_t num = 0, den = 1;
+  farey_fraction(f1 % f2, f2, 1048575, num, den);
+
+  uint32_t p1 = (mult << 7) + ((128 * num) / den) - 512;
+  uint32_t p2 = (num << 7) - (den * ((128 * num) / den));
+  uint32_t p3 = den;
+
+  set(map, base, (p3 >> 8) & 0xFF);
+  set(map, base + 1, p3 & 0xFF);
+  set(map, base + 2, (r_div << 4) | ((p1 >> 16) & 0x03));
+  set(map, base + 3, (p1 >> 8) & 0xFF);
+  set(map, base + 4, p1 & 0xFF);
+  set(map, base + 5, ((p3 >> 12) & 0xF0) | ((p2 >> 16) & 0x0F));
+  set(map, base + 6, (p2 >> 8) & 0xFF);
+  set(map, base + 7, p2 & 0xFF);
+
+  return (num == 0) && ((mult & 1) == 0);
+}
+
+constexpr int ratio_score(uint64_t f1, uint64_t f2)
+{
+  return ((f1 % f2) != 0) ? 0 : (((f1 / f2) & 1) ? 1 : 2);
+}
+
+constexpr uint32_t r_scale(uint32_t freq, uint8_t &r_div)
+{
+  r_div = 0;
+  while ((freq < 500000) && (r_div < 7)) {
+    r_div++;
+    freq *= 2;
+  }
+  return freq;
+}
+
+// Same as si5351_r_scale_int() and si5351_int_divider() - CLK6 and CLK7 only have an 8-bit even
+// integer divider
+constexpr uint32_t r_scale_int(uint32_t freq, uint32_t vco_freq, uint8_t &r_div)
+{
+  r_div = 0;
+  while (((uint64_t) freq * 254 < vco_freq) && (r_div < 7)) {
+    r_div++;
+    freq *= 2;
+  }
+  return freq;
+}
+
+constexpr uint32_t int_divider(uint32_t vco_freq, uint32_t freq)
+{
+  if ((freq == 0) || ((vco_freq % freq) != 0)) return 0;
+  uint32_t div = vco_freq / freq;
+  return ((div & 1) || (div < 6) || (div > 254)) ? 0 : div;
+}
+
+constexpr int outputs(const config &c)
+{
+  return (c.variant == SI5351_VARIANT_A_10) ? SI5351_CLOCKS_A_10 : SI5351_CLOCKS;
+}
+
+// Same VCO choice as si5351_choose_vco() in si5351.c
+constexpr uint32_t choose_vco(const config &c, int pll, int master, uint32_t freq)
+{
+  uint32_t best = 0;
+  int best_score = -1;
+  uint32_t first = ((SI5351_VCO_MIN / freq) + 3) & ~1;
+  if (first < 8) first = 8;
+  uint32_t last = 2046;
+  if (master >= 6) {
+    first = (((SI5351_VCO_MIN + freq - 1) / freq) + 1) & ~1;
+    if (first < 6) first = 6;
+    last = 254;
+  }
+
+  for (uint32_t div = first; (div <= last) && ((uint64_t) freq * div <= SI5351_VCO_MAX); div += 2) {
+    uint32_t vco_freq = freq * div;
+    int score = ratio_score(vco_freq, c.crystal_freq);
+    for (int i=0; i<outputs(c); i++) {
+      const clock_config &clk = c.clock[i];
+      if ((clk.freq == 0) || (clk.pll != pll) || (i == master)) continue;
+      if ((clk.freq < SI5351_MIN_FREQ) || (clk.freq > SI5351_MAX_FREQ)) continue;
+      uint8_t r_div = 0;
+      if (i >= 6) {
+        if (int_divider(vco_freq, r_scale_int(clk.freq, vco_freq, r_div)) == 0) {
+          score = -1;
+          break;
+        }
+        continue;
+      }
+      score += ratio_score(vco_freq, r_scale(clk.freq, r_div));
+    }
+    if (score > best_score) {
+      best = vco_freq;
+      best_score = score;
+    }
+  }
+
+  return best;
+}
+
+constexpr regmap compute(const config &c)
+{
+  regmap map = {};
+  uint8_t fb_int = 0;
+
+  set(map, SI5351_REG_CLK3_0_DISABLE_STATE,
+    (c.clock[3].disable << 6) | (c.clock[2].disable << 4) | (c.clock[1].disable << 2) | c.clock[0].disable);
+  if (outputs(c) > 4) {
+    set(map, SI5351_REG_CLK7_4_DISABLE_STATE,
+      (c.clock[7].disable << 6) | (c.clock[6].disable << 4) | (c.clock[5].disable << 2) | c.clock[4].disable);
+  }
+  for (int i=outputs(c); i<SI5351_CLOCKS; i++) {
+    if (c.clock[i].freq != 0) invalid_configuration("Clock not present on this part");
+  }
+
+  set(map, SI5351_REG_CRYSTAL_INTERNAL_LOAD_CAPACITANCE, 0x48 | c.crystal_load);
+
+  for (int i=0; i<SI5351_PLLS; i++) {
+    int master = -1;
+    bool in_use = false;
+    for (int j=0; j<outputs(c); j++) {
+      if ((c.clock[j].freq != 0) && (c.clock[j].pll == i)) in_use = true;
+      if ((c.clock[j].pll == i) && c.clock[j].pll_master) master = j;
+    }
+    if (!in_use) continue;
+
+    // As in si5351_set(), a PLL with no master takes its frequency from clock 0
+    if (master < 0) master = 0;
+    uint32_t freq = c.clock[master].freq;
+    if ((freq < SI5351_MIN_FREQ) || (freq > SI5351_MAX_FREQ)) invalid_configuration("PLL master frequency out of range");
+
+    uint8_t vco_ri = 0;
+    uint32_t scaled = (master >= 6) ? r_scale_int(freq, SI5351_VCO_MAX, vco_ri) : r_scale(freq, vco_ri);
+    uint32_t vco_freq = choose_vco(c, i, master, scaled);
+    if (vco_freq == 0) invalid_configuration("No VCO frequency available");
+    map.vco_freq[i] = vco_freq;
+
+    // As si5351_compute_feedback() - the integer mode bits are in the CLK6 and CLK7 control registers
+    if (multisynth(map, SI5351_REG_MSN_PLL_BASE + (i * 8), vco_freq, c.crystal_freq, 0) && (outputs(c) > 6)) fb_int |= (1 << i);
+
+    // Plans have no spread spectrum, so make sure it's off - as si5351_compute_spread()
+    if (i == SI5351_PLL_A) set(map, SI5351_REG_SSC_BASE, 0);
+  }
+
+  // CLK6 and CLK7 control bit 6 is the feedback integer mode bit for PLL A and PLL B
+  uint8_t oe = 0xFF;
+  uint8_t r67 = 0;
+  for (int i=0; i<outputs(c); i++) {
+    const clock_config &clk = c.clock[i];
+    uint8_t ctrl = 0x80;
+    if ((i >= 6) && (fb_int & (1 << (i - 6)))) ctrl |= 0x40;
+    if (clk.freq == 0) {
+      set(map, SI5351_REG_CLK0_CONTROL + i, ctrl);
+      continue;
+    }
+    oe &= ~(1 << i);
+    if ((clk.pll != SI5351_PLL_A) && (clk.pll != SI5351_PLL_B)) invalid_configuration("PLL out of range");
+
+    if ((clk.freq < SI5351_MIN_FREQ) || (clk.freq > SI5351_MAX_FREQ)) invalid_configuration("Frequency out of range");
+    if (clk.phase > SI5351_PHASE_MAX) invalid_configuration("Phase out of range");
+    uint8_t r_div = 0;
+    if (i >= 6) {
+      // CLK6 and CLK7 - as si5351_compute_output()
+      uint32_t div = int_divider(map.vco_freq[clk.pll], r_scale_int(clk.freq, map.vco_freq[clk.pll], r_div));
+      if (div == 0) invalid_configuration("CLK6/CLK7 needs an even integer divider");
+      if (clk.phase != 0) invalid_configuration("CLK6/CLK7 has no phase offset");
+      set(map, SI5351_REG_MS6_P1 + (i - 6), div);
+      r67 |= r_div << ((i - 6) * 4);
+      set(map, SI5351_REG_CLK6_7_R_DIV, r67);
+      map.ms_int |= (1 << i);
+      set(map, SI5351_REG_CLK0_CONTROL + i, (ctrl & 0x40) | ((clk.pll << 5) & 0x20) | (clk.invert ? 0x10 : 0) | 0x0C | (clk.drive & 0x03));
+      continue;
+    }
+    uint32_t freq = r_scale(clk.freq, r_div);
+    // As si5351_encode_output() - the output multisynth divides by 8 to 2048
+    if (((uint64_t) freq * 8 > map.vco_freq[clk.pll]) || ((uint64_t) freq * 2048 < map.vco_freq[clk.pll])) {
+      invalid_configuration("Frequency can't be derived from the VCO");
+    }
+
+    bool ms_int = multisynth(map, SI5351_REG_CLK_SYNTH_BASE + (i * 8), map.vco_freq[clk.pll], freq, r_div);
+    set(map, SI5351_REG_PHASE_BASE + i, clk.phase);
+    ctrl = (ctrl & 0x40) | ((clk.pll << 5) & 0x20) | (clk.invert ? 0x10 : 0) | 0x0C | (clk.drive & 0x03);
+    if ((i < 6) && ms_int) {
+      ctrl |= 0x40;
+      map.ms_int |= (1 << i);
+    }
+    set(map, SI5351_REG_CLK0_CONTROL + i, ctrl);
+  }
+  set(map, SI5351_REG_OE, oe);
+  map.fb_int = fb_int;
+
+  return map;
+}
+
+// Outputs are disabled, the other registers are sent as runs of consecutive registers, the
+// PLLs are reset and then the outputs are enabled - each record is (register, count, values...)
+template <typename F>
+constexpr size_t encode(const regmap &map, F &&emit)
+{
+  size_t n = 0;
+  emit(n++, SI5351_REG_OE);
+  emit(n++, 1);
+  emit(n++, 0xFF);
+
+  int reg = 0;
+  while (reg < SI5351_REGISTERS) {
+    if ((reg == SI5351_REG_OE) || !map.used[reg]) {
+      reg++;
+      continue;
+    }
+    int end = reg;
+    while ((end < SI5351_REGISTERS) && (end != SI5351_REG_OE) && map.used[end]) end++;
+    emit(n++, reg);
+    emit(n++, end - reg);
+    for (; reg < end; reg++) emit(n++, map.reg[reg]);
+  }
+
+  uint8_t pll_reset = 0;
+  if (map.used[SI5351_REG_MSN_PLL_BASE]) pll_reset |= SI5351_PLL_RESET_A;
+  if (map.used[SI5351_REG_MSN_PLL_BASE + 8]) pll_reset |= SI5351_PLL_RESET_B;
+  if (pll_reset != 0) {
+    emit(n++, SI5351_REG_PLL_RESET);
+    emit(n++, 1);
+    emit(n++, pll_reset);
+  }
+
+  emit(n++, SI5351_REG_OE);
+  emit(n++, 1);
+  emit(n++, map.reg[SI5351_REG_OE]);
+  return n;
+}
+
+struct counter {
+  constexpr void operator()(size_t, uint8_t) const {}
+};
+
+template <size_t N, const config *C>
+struct writer {
+  image<N, C> &out;
+  constexpr void operator()(size_t i, uint8_t val) const { out.data[i] = val; }
+};
+
+constexpr size_t image_size(const config &c)
+{
+  return encode(compute(c), counter{});
+}
+
+} // namespace detail
+
+// Build the register image for a plan at compile time
+template <const config &C>
+constexpr image<detail::image_size(C), &C> build()
+{
+  image<detail::image_size(C), &C> out = {};
+  detail::encode(detail::compute(C), detail::writer<detail::image_size(C), &C>{out});
+  return out;
+}
+
+// Program the chip from a prebuilt image and bring the driver state in line with the plan,
+// so later calls such as si5351_set() or si5351_retune() carry on from it.  Holds the driver's
+// lock throughout, like the other calls which change its state.  The image has to be the one
+// built for C - anything else doesn't compile.
+template <const config &C>
+inline int load(si5351_t *si5351, const image<detail::image_size(C), &C> &img)
+{
+  constexpr detail::regmap map = detail::compute(C);
+
+  // The crystal and part are in the descriptor the driver was set up with, which the plan has to match
+  if ((si5351->desc->crystal_freq != C.crystal_freq) || (si5351->desc->crystal_load != C.crystal_load) ||
+      (si5351->desc->variant != C.variant)) {
+    return -1;
+  }
+
+  if (si5351->lock != NULL) si5351->lock(si5351->lock_arg);
+  if (si5351->pending != NULL) {
+    // Nothing is touched while a transfer is in flight, as si5351_load_image()
+    if (si5351->unlock != NULL) si5351->unlock(si5351->lock_arg);
+    return -1;
+  }
+  si5351->crystal_ppb = 0;
+  si5351->spread = 0;
+  si5351->spread_center = false;
+  for (int i=0; i<SI5351_CLOCKS; i++) {
+    si5351->freq[i] = C.clock[i].freq;
+    si5351->freq_frac[i] = 0;
+    si5351->clk[i].phase = C.clock[i].phase;
+    si5351->clk[i].pll = C.clock[i].pll;
+    si5351->clk[i].invert = C.clock[i].invert;
+    si5351->clk[i].drive = C.clock[i].drive;
+    si5351->clk[i].disable = C.clock[i].disable;
+    if (C.clock[i].pll_master) si5351->clk_pll[C.clock[i].pll] = i;
+  }
+  for (int i=0; i<SI5351_PLLS; i++) {
+    si5351->vco_freq[i] = map.vco_freq[i];
+    si5351->vco_fixed[i] = 0;
+  }
+  si5351->fb_int = map.fb_int;
+  si5351->ms_int = map.ms_int;
+  si5351->staged = 0;
+
+  int ret = si5351_load_image(si5351, img.data, img.size);
+  if (ret == 0) si5351->changed = 0;
+  if (si5351->unlock != NULL) si5351->unlock(si5351->lock_arg);
+  return ret;
+}
+
+} // namespace si5351
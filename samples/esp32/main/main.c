@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "driver/gpio.h"
@@ -52,6 +53,16 @@ int si5351_write(void *dev, uint8_t reg, uint8_t val)
     return 0;
 }
 
+int si5351_write_block(void *dev, uint8_t reg, const uint8_t *buf, size_t len)
+{
+    uint8_t data[SI5351_REGISTERS + 1];
+    if (len > SI5351_REGISTERS) return -1;
+    data[0] = reg;
+    memcpy(&data[1], buf, len);
+    ESP_LOGI(TAG, "Write block: %02x len %d", reg, len);
+    return (i2c_master_transmit(dev, data, len + 1, -1) == ESP_OK) ? 0 : -1;
+}
+
 void si5351_log(const char *fmt, ...)
 {
     char buf[256];
@@ -72,7 +83,8 @@ void app_main(void)
     i2c_init();
 
     si5351_t si5351;
-    si5351_init(&si5351, i2c_si5351_handle, SI5351_CRYSTAL_FREQ_27MHZ, SI5351_CRYSTAL_LOAD_8PF, &si5351_write, &si5351_log);
+    si5351_init(&si5351, i2c_si5351_handle, SI5351_CRYSTAL_FREQ_27MHZ, SI5351_CRYSTAL_LOAD_8PF, SI5351_VARIANT_A_20, &si5351_write, &si5351_log);
+    si5351_set_write_block(&si5351, &si5351_write_block);
     si5351_set(&si5351, 0, SI5351_PLL_A, 2000000, 0, false, true);
     si5351_set(&si5351, 1, SI5351_PLL_A, 2000000, 0, true, false);
 
@@ -7,285 +7,2786 @@
  */
 
 #include "../include/si5351.h"
-#include <math.h>
 #include <string.h>
 
-#define LOG(fmt, ...) if (si5351->log != NULL) si5351->log(fmt, ##__VA_ARGS__)
+// Messages above SI5351_LOG_LEVEL are compiled out altogether, arguments and all
+#ifndef SI5351_LOG_LEVEL
+#define SI5351_LOG_LEVEL SI5351_LOG_DEBUG
+#endif
+
+#if SI5351_LOG_LEVEL >= SI5351_LOG_ERROR
+#define LOGE(fmt, ...) if (si5351->desc->log != NULL) si5351->desc->log(fmt, ##__VA_ARGS__)
+#else
+#define LOGE(fmt, ...) do { } while (0)
+#endif
+
+#if SI5351_LOG_LEVEL >= SI5351_LOG_DEBUG
+#define LOGD(fmt, ...) if (si5351->desc->log != NULL) si5351->desc->log(fmt, ##__VA_ARGS__)
+#else
+#define LOGD(fmt, ...) do { } while (0)
+#endif
+
+// Optional lock around anything which touches the driver state or the bus
+#define LOCK() if (si5351->lock != NULL) si5351->lock(si5351->lock_arg)
+#define UNLOCK() if (si5351->unlock != NULL) si5351->unlock(si5351->lock_arg)
+
+// Optional counters and timing hooks
+#define STATS_ADD(field, n) if (si5351->stats != NULL) si5351->stats->field += (n)
+#define EVENT(ev) if ((si5351->stats != NULL) && (si5351->stats->event != NULL)) si5351->stats->event(si5351->stats->event_arg, ev)
+
+// What has changed since the chip was last configured - see si5351_t.changed
+#define SI5351_CHANGED_CONTROL (0x01)       // Drive strength or disable state only
+#define SI5351_CHANGED_CONFIG (0x02)        // Anything which needs the whole image recomputing
+#define SI5351_CHANGED_RETUNE (0x04)        // Outputs retuned during a batch - see si5351_t.staged
+
+// Common denominator of the output divider fractions in a sweep
+#define SI5351_SWEEP_DEN (1048575)
+
+// Range of the 8-bit integer dividers on CLK6 and CLK7, which must also be even
+#define SI5351_INT_DIV_MIN (6)
+#define SI5351_INT_DIV_MAX (254)
+
+// Longest run of unchanged registers we'll rewrite to avoid splitting a block write
+#define SI5351_RUN_GAP (2)
 
 // Rather nice algorithm to calculate the closest fractional approximation to a real number
 // given contstraints on the denominator.
 // This is used to calculate the PLL multiplier and dividers for the Si5351
+//
+// Rather than walking the Farey sequence one mediant at a time, this jumps straight to
+// each continued fraction convergent of p/q, which takes at most a few dozen steps for
+// any denominator limit we use.  Everything is exact integer arithmetic - the remainders
+// of Euclid's algorithm give us the error of each candidate without any multiplication
+// which could overflow.  Returns the number of steps taken.
 
-static void farey_fraction(float f, uint32_t max_denominator, uint32_t *num, uint32_t *den)
+static uint32_t farey_fraction(uint64_t p, uint64_t q, uint32_t max_denominator, uint32_t *num, uint32_t *den)
 {
-    if (f <= 0 || f >= 1 || max_denominator <= 1)
+    if ((p == 0) || (p >= q) || (max_denominator <= 1))
     {
         *num = 0;
         *den = 1;
-        return;
+        return 0;
     }
 
-    uint32_t a = 0, b = 1, c = 1, d = 1;
-    while (1) {
-        uint32_t mediant_num = a + c;
-        uint32_t mediant_den = b + d;
-        if (mediant_den > max_denominator) {
+    // p0/q0 and p1/q1 are the last two convergents; n/d is what's left of p/q
+    uint64_t p0 = 0, q0 = 1, p1 = 1, q1 = 0;
+    uint64_t n = p, d = q;
+    uint32_t steps = 0;
+    while (d != 0) {
+        steps++;
+        uint64_t a = n / d;
+        uint64_t q2 = q0 + a * q1;
+        if (q2 > max_denominator) {
             break;
         }
-        if (f < ((float) mediant_num)/mediant_den) {
-            c = mediant_num;
-            d = mediant_den;
-        } else {
-            a = mediant_num;
-            b = mediant_den;
-        }
-    }   
+        uint64_t p2 = p0 + a * p1;
+        p0 = p1;
+        q0 = q1;
+        p1 = p2;
+        q1 = q2;
+        uint64_t r = n - a * d;
+        n = d;
+        d = r;
+    }
+
+    if (d == 0) {
+        // Exact
+        *num = p1;
+        *den = q1;
+        return steps;
+    }
 
-    if (fabs(f - ((float) a)/b) < fabs(f - ((float) c)/d)) {
-        *num = a;
-        *den = b;
+    // Best semiconvergent below the limit.  |p/q - p1/q1| = d/(q*q1) and
+    // |p/q - (p0 + k*p1)/(q0 + k*q1)| = (n - k*d)/(q*(q0 + k*q1))
+    uint64_t k = (max_denominator - q0) / q1;
+    uint64_t sq = q0 + k * q1;
+    if ((n - k * d) * q1 < d * sq) {
+        *num = p0 + k * p1;
+        *den = sq;
     } else {
-        *num = c;
-        *den = d;
+        *num = p1;
+        *den = q1;
     }
+    return steps;
 }
 
-static void si5351_calc_multisynth(si5351_t *si5351, uint32_t f1, uint32_t f2, uint32_t *pll)
+// Look a multisynth solution up in the cache, moving it to the front if it's there
+static bool si5351_cache_lookup(si5351_cache_t *cache, uint64_t f1, uint64_t f2, uint32_t *pll, bool *integer)
 {
-    LOG("MS: %ld %ld", f1, f2);
+    for (int i=0; i<cache->count; i++) {
+        if ((cache->entry[i].f1 != f1) || (cache->entry[i].f2 != f2)) continue;
+        si5351_cache_entry_t hit = cache->entry[i];
+        memmove(&cache->entry[1], &cache->entry[0], i * sizeof(si5351_cache_entry_t));
+        cache->entry[0] = hit;
+        memcpy(pll, hit.pll, sizeof(hit.pll));
+        *integer = hit.integer;
+        cache->hits++;
+        return true;
+    }
+    cache->misses++;
+    return false;
+}
+
+// Add a solution to the front of the cache, dropping the least recently used if it's full
+static void si5351_cache_insert(si5351_cache_t *cache, uint64_t f1, uint64_t f2, const uint32_t *pll, bool integer)
+{
+    if (cache->count < SI5351_CACHE_LEN) cache->count++;
+    memmove(&cache->entry[1], &cache->entry[0], (cache->count - 1) * sizeof(si5351_cache_entry_t));
+    cache->entry[0].f1 = f1;
+    cache->entry[0].f2 = f2;
+    memcpy(cache->entry[0].pll, pll, sizeof(cache->entry[0].pll));
+    cache->entry[0].integer = integer;
+}
+
+// Calculate the parameters for a multisynth dividing f1 by f2.  Returns true if the ratio is
+// an even integer, which is the case where the multisynth can be put into integer mode.  If
+// fixed_den isn't 0, the fractional part is rounded to that denominator rather than being the
+// closest one under the limit.  Best-fraction solutions come from the cache if there is one;
+// fixed denominators are only used for sweeps, whose points aren't worth keeping.
+static bool si5351_calc_multisynth(const si5351_t *si5351, uint64_t f1, uint64_t f2, uint32_t fixed_den, uint32_t *pll)
+{
+    bool integer;
+    si5351_cache_t *cache = (fixed_den == 0) ? si5351->cache : NULL;
+    if ((cache != NULL) && si5351_cache_lookup(cache, f1, f2, pll, &integer)) {
+        STATS_ADD(cache_hits, 1);
+        return integer;
+    }
+
+    LOGD("MS: %lld %lld", f1, f2);
     // Calculate the ref->PLL nultiplier and divider
     uint32_t pll_mult = f1 / f2;
     uint32_t pll_num;
     uint32_t pll_den;
-    farey_fraction(((float)(f1) / f2) - pll_mult , 1048575, &pll_num, &pll_den);
+    if (fixed_den != 0) {
+        pll_den = fixed_den;
+        pll_num = (((f1 % f2) * fixed_den) + (f2 / 2)) / f2;
+        if (pll_num == fixed_den) {
+            pll_mult++;
+            pll_num = 0;
+        }
+    } else {
+        uint32_t steps = farey_fraction(f1 % f2, f2, 1048575, &pll_num, &pll_den);
+        STATS_ADD(farey_iterations, steps);
+    }
 
-    LOG("F1: %ld, F2: %ld, PLL Mult: %ld, Num: %ld, Den: %ld", f1, f2, pll_mult, pll_num, pll_den);
+    LOGD("F1: %lld, F2: %lld, PLL Mult: %ld, Num: %ld, Den: %ld", f1, f2, pll_mult, pll_num, pll_den);
 
     // Calculate PLL parameters
     pll[0] = (pll_mult << 7) + ((128 * pll_num) / pll_den) - 512;
     pll[1] = (pll_num << 7) - (pll_den * ((128 * pll_num) / pll_den));
     pll[2] = pll_den;
-    LOG("Multisynth parameters: %08lx %08lx %08lx", pll[0], pll[1], pll[2]);
+    LOGD("Multisynth parameters: %08lx %08lx %08lx", pll[0], pll[1], pll[2]);
+
+    integer = (pll_num == 0) && ((pll_mult & 1) == 0);
+    if (cache != NULL) {
+        si5351_cache_insert(cache, f1, f2, pll, integer);
+    }
+    return integer;
 }
 
-// Configure SI5351 
-static int si5351_configure(si5351_t *si5351)
+// How good a divider f1/f2 makes - 2 for an even integer, 1 for an odd integer, 0 for fractional
+static int si5351_ratio_score(uint64_t f1, uint64_t f2)
 {
-    // Check if we're in config mode..
-    if (!si5351->config) {
+    if ((f1 % f2) != 0) return 0;
+    return ((f1 / f2) & 1) ? 1 : 2;
+}
+
+// Scale a frequency up by the output R divider to get a pre-R frequency of at least 500kHz - AN619
+static uint32_t si5351_r_scale(uint32_t freq, uint8_t *r_div)
+{
+    *r_div = 0;
+    while ((freq < 500000) && (*r_div < 7)) {
+        *r_div += 1;
+        freq *= 2;
+    }
+    return freq;
+}
+
+// As si5351_r_scale(), for CLK6 and CLK7 - scale up until the VCO can be divided down to the
+// pre-R frequency by the 8-bit divider
+static uint32_t si5351_r_scale_int(uint32_t freq, uint32_t vco_freq, uint8_t *r_div)
+{
+    *r_div = 0;
+    while (((uint64_t) freq * SI5351_INT_DIV_MAX < vco_freq) && (*r_div < 7)) {
+        *r_div += 1;
+        freq *= 2;
+    }
+    return freq;
+}
+
+// The CLK6/CLK7 divider giving a pre-R frequency, or 0 if it isn't an even integer in range
+static uint32_t si5351_int_divider(uint32_t vco_freq, uint32_t freq)
+{
+    if ((freq == 0) || ((vco_freq % freq) != 0)) {
         return 0;
     }
+    uint32_t div = vco_freq / freq;
+    if ((div & 1) || (div < SI5351_INT_DIV_MIN) || (div > SI5351_INT_DIV_MAX)) {
+        return 0;
+    }
+    return div;
+}
 
-    // Set output disable state
-    si5351->write(si5351->dev, SI5351_REG_CLK3_0_DISABLE_STATE, 
-        (si5351->clk_dis[3] << 6) | (si5351->clk_dis[2] << 4) | (si5351->clk_dis[1] << 2) | si5351->clk_dis[0]);
-    si5351->write(si5351->dev, SI5351_REG_CLK7_4_DISABLE_STATE, 
-        (si5351->clk_dis[7] << 6) | (si5351->clk_dis[6] << 4) | (si5351->clk_dis[5] << 2) | si5351->clk_dis[4]);
+// How many outputs the part has
+static int si5351_outputs(const si5351_t *si5351)
+{
+    return (si5351->desc->variant == SI5351_VARIANT_A_10) ? SI5351_CLOCKS_A_10 : SI5351_CLOCKS;
+}
+
+static bool si5351_output_valid(const si5351_t *si5351, int output)
+{
+    return (output >= 0) && (output < si5351_outputs(si5351));
+}
 
-    // Disable outputs
-    si5351->write(si5351->dev, SI5351_REG_OE, 0xFF);
+static void si5351_image_set(si5351_regmap_t *image, uint8_t reg, uint8_t val)
+{
+    image->reg[reg] = val;
+    image->used[reg >> 3] |= (1 << (reg & 7));
+}
 
-    for (int i=0; i<SI5351_CLOCKS; i++) {
-        si5351->write(si5351->dev, SI5351_REG_CLK0_CONTROL + i, 0x80);
+static bool si5351_image_used(const si5351_regmap_t *image, uint8_t reg)
+{
+    return (image->used[reg >> 3] & (1 << (reg & 7))) != 0;
+}
+
+// Pack multisynth parameters into the 8-byte MSNx/MSx register layout
+static void si5351_pack_params(uint8_t *buf, const uint32_t *pll, uint8_t r_div)
+{
+    buf[0] = (pll[2] >> 8) & 0xFF;
+    buf[1] = pll[2] & 0xFF;
+    buf[2] = (r_div << 4) | ((pll[0] >> 16) & 0x03);
+    buf[3] = (pll[0] >> 8) & 0xFF;
+    buf[4] = pll[0] & 0xFF;
+    buf[5] = ((pll[2] >> 12) & 0xF0) | ((pll[1] >> 16) & 0x0F);
+    buf[6] = (pll[1] >> 8) & 0xFF;
+    buf[7] = pll[1] & 0xFF;
+}
+
+// Get the divider a + b/c back out of a packed MSNx/MSx register block.  P1 = 128a + floor(128b/c) - 512
+// and P2 = 128b - c*floor(128b/c), and floor(128b/c) < 128, so this is exact.
+static void si5351_unpack_params(const uint8_t *buf, uint32_t *a, uint32_t *b, uint32_t *c)
+{
+    uint32_t p1 = ((uint32_t) (buf[2] & 0x03) << 16) | ((uint32_t) buf[3] << 8) | buf[4];
+    uint32_t p2 = ((uint32_t) (buf[5] & 0x0F) << 16) | ((uint32_t) buf[6] << 8) | buf[7];
+    uint32_t p3 = ((uint32_t) (buf[5] & 0xF0) << 12) | ((uint32_t) buf[0] << 8) | buf[1];
+    if (p3 == 0) p3 = 1;
+    *a = (p1 + 512) / 128;
+    *b = ((((p1 + 512) % 128) * p3) + p2) / 128;
+    *c = p3;
+}
+
+// x * y / z without overflowing, as long as y and z fit in 32 bits
+static uint64_t si5351_muldiv(uint64_t x, uint32_t y, uint32_t z)
+{
+    return ((x / z) * y) + (((x % z) * y) / z);
+}
+
+// The crystal frequency in Hz * 2^SI5351_FREQ_SHIFT, with the calibration applied
+static uint64_t si5351_crystal_q(const si5351_t *si5351)
+{
+    int64_t correction = ((int64_t) si5351->desc->crystal_freq * si5351->crystal_ppb * (1 << SI5351_FREQ_SHIFT)) / 1000000000;
+    return ((uint64_t) si5351->desc->crystal_freq << SI5351_FREQ_SHIFT) + correction;
+}
+
+// Work out the frequency an output actually runs at, in Hz * 2^SI5351_FREQ_SHIFT, from the
+// register values which set it.  Returns 0 if the output is powered down.
+static uint64_t si5351_decode_freq(const si5351_t *si5351, const uint8_t *reg, int output)
+{
+    uint8_t ctrl = reg[SI5351_REG_CLK0_CONTROL + output];
+    if (ctrl & 0x80) {
+        return 0;
     }
+    const uint8_t *fb = &reg[SI5351_REG_MSN_PLL_BASE + ((ctrl & 0x20) ? 8 : 0)];
+    const uint8_t *ms = &reg[SI5351_REG_CLK_SYNTH_BASE + (output * 8)];
 
-    // Set crystal load capacitance
-    si5351->write(si5351->dev, SI5351_REG_CRYSTAL_INTERNAL_LOAD_CAPACITANCE, 0x48 | si5351->crystal_load);
-    
-    // Calculate VCO frequencies
-    for (int i=0; i<SI5351_PLLS; i++) {
+    // VCO = crystal * (a + b/c)
+    uint32_t a, b, c;
+    si5351_unpack_params(fb, &a, &b, &c);
+    uint64_t vco_q = si5351_muldiv(si5351_crystal_q(si5351), (a * c) + b, c);
 
-        // Calculate a sensible VCO frequency - even multiple of target, in the range 600-900MHz
-        if (si5351->clk_pll[i] >= SI5351_CLOCKS) {
-            LOG("Clock %d out of range for PLL %d", si5351->clk_pll[i], i);
-            return -1;
-        }
-        uint32_t freq = si5351->freq[si5351->clk_pll[i]];
-        if ((freq < SI5351_MIN_FREQ) || (freq > SI5351_MAX_FREQ)) {
-            LOG("Frequency %lu out of range", freq);
-            return -1;
-        } 
-
-        uint8_t vco_ri = 0;
-        // Get a value for R which gives a pre-R frequency of at least 500kHz - AN619
-        while (freq < 500000) {
-            freq *= 2;
-            vco_ri++;
-        }   
-
-        uint32_t omd_div = (uint32_t)((600000000.0/freq) + 3) & ~1;
-        if ((omd_div < 8) || (omd_div > 2047)) {
-            LOG("Calculated OMD %ld out of range", omd_div);
-            return -1;
+    // CLK6 and CLK7 - output = VCO / divider / R
+    if (output >= 6) {
+        uint32_t div = reg[SI5351_REG_MS6_P1 + (output - 6)];
+        if (div == 0) {
+            return 0;
         }
+        return (vco_q / div) >> ((reg[SI5351_REG_CLK6_7_R_DIV] >> ((output - 6) * 4)) & 0x07);
+    }
 
-        uint32_t vco_freq = freq * omd_div;   
-        if ((vco_freq < SI5351_VCO_MIN) || (vco_freq > SI5351_VCO_MAX)) {
-            LOG("Calculated VCO frequency %lu out of eange", vco_freq);
-            return -1;
-        }
-        si5351->vco_freq[i] = vco_freq;
+    // Output = VCO / (a + b/c) / R
+    si5351_unpack_params(ms, &a, &b, &c);
+    uint32_t n = (a * c) + b;
+    if (n == 0) {
+        return 0;
+    }
+    return si5351_muldiv(vco_q, c, n) >> ((ms[2] >> 4) & 0x07);
+}
 
-        uint32_t pll[4];
-        si5351_calc_multisynth(si5351, vco_freq, si5351->crystal_freq, pll);
+static void si5351_image_block(si5351_regmap_t *image, uint8_t base, const uint8_t *buf)
+{
+    for (int i=0; i<SI5351_MS_REGS; i++) {
+        si5351_image_set(image, base + i, buf[i]);
+    }
+}
 
-        // Write to PLL registers
-        si5351->write(si5351->dev, SI5351_REG_MSN_PLL_BASE + (i * 8), (pll[2] >> 8) & 0xFF);
-        si5351->write(si5351->dev, SI5351_REG_MSN_PLL_BASE + (i * 8) + 1, pll[2] & 0xFF);
-        si5351->write(si5351->dev, SI5351_REG_MSN_PLL_BASE + (i * 8) + 2, (pll[0] >> 16) & 0x03);
-        si5351->write(si5351->dev, SI5351_REG_MSN_PLL_BASE + (i * 8) + 3, (pll[0] >> 8) & 0xFF);
-        si5351->write(si5351->dev, SI5351_REG_MSN_PLL_BASE + (i * 8) + 4, pll[0] & 0xFF);
-        si5351->write(si5351->dev, SI5351_REG_MSN_PLL_BASE + (i * 8) + 5, (((pll[2] >> 16) & 0x0F) << 4) | ((pll[1] >> 16) & 0x0f));
-        si5351->write(si5351->dev, SI5351_REG_MSN_PLL_BASE + (i * 8) + 6, (pll[1] >> 8) & 0xFF);
-        si5351->write(si5351->dev, SI5351_REG_MSN_PLL_BASE + (i * 8) + 7, pll[1] & 0xFF);
+// CLKx_CONTROL for an output.  On CLK6 and CLK7, bit 6 is the integer mode bit for the PLL A
+// and PLL B feedback multisynths rather than for the output's own multisynth.
+static uint8_t si5351_control(const si5351_t *si5351, int i, uint8_t fb_int, bool ms_int, bool enabled)
+{
+    uint8_t ctrl = 0x80;
+    if (enabled) {
+        ctrl = ((si5351->clk[i].pll << 5) & 0x20) | (si5351->clk[i].invert ? 0x10: 0) | (0x0C) | (si5351->clk[i].drive & 0x03);
+    }
+    if (i >= 6) {
+        if (fb_int & (1 << (i - 6))) ctrl |= 0x40;
+    } else if (enabled && ms_int) {
+        ctrl |= 0x40;
     }
+    return ctrl;
+}
 
-    // Set clock frequencies
-    for (int i=0; i<SI5351_CLOCKS; i++) {
-        LOG("Clock %d freq %ld", i, si5351->freq[i]);
-        if (si5351->freq[i] == 0) continue;
+static bool si5351_shadow_valid(const si5351_t *si5351, uint8_t reg)
+{
+    return (si5351->shadow_valid[reg >> 3] & (1 << (reg & 7))) != 0;
+}
 
-        if (si5351->pll[i] >= SI5351_PLLS) {
-            LOG("PLL %d out of range", si5351->pll[i]);
-            return -1;
-        }
+// How good a feedback divider a VCO frequency makes, as si5351_ratio_score().  This is against
+// the nominal crystal frequency, so that trimming the calibration never picks a different VCO.
+static int si5351_crystal_score(const si5351_t *si5351, uint32_t vco_freq)
+{
+    return si5351_ratio_score(vco_freq, si5351->desc->crystal_freq);
+}
 
-        uint32_t vco_freq = si5351->vco_freq[si5351->pll[i]];
+// Work out the feedback multisynth registers for a PLL from its VCO frequency
+static void si5351_compute_feedback(const si5351_t *si5351, int i, uint32_t vco_freq, si5351_regmap_t *image)
+{
+    uint32_t pll[4];
+    uint8_t buf[SI5351_MS_REGS];
+    bool integer = si5351_calc_multisynth(si5351, (uint64_t) vco_freq << SI5351_FREQ_SHIFT, si5351_crystal_q(si5351), 0, pll);
+    // Spread spectrum needs the PLL A feedback multisynth in fractional mode.  The integer mode
+    // bits are in the CLK6 and CLK7 control registers, so a part without those never has it.
+    if (integer && !((i == SI5351_PLL_A) && (si5351->spread != 0)) && (si5351_outputs(si5351) > 6)) {
+        image->fb_int |= (1 << i);
+    } else {
+        image->fb_int &= ~(1 << i);
+    }
+    si5351_pack_params(buf, pll, 0);
+    si5351_image_block(image, SI5351_REG_MSN_PLL_BASE + (i * 8), buf);
+}
 
-        uint32_t freq = si5351->freq[i];
-        if (freq < SI5351_MIN_FREQ || freq > SI5351_MAX_FREQ) {
-            LOG("Frequency %lu out of range", freq);
-            return -1;
-        }
+// Work out the spread spectrum registers from the PLL A feedback divider M = a + b/c already in
+// the image - AN619.  With SSUDP = Fpfd / (4 * 31.5kHz) and the spread s in 0.01% units:
+//   down spread:   SSDN = 64 * s * M / ((10000 + s) * SSUDP), SSUP = 0
+//   center spread: SSUP = 128 * s * M / ((10000 - s) * SSUDP), SSDN = 128 * s * M / ((10000 + s) * SSUDP)
+// each split into P1 = floor(x), P2 = 32767 * frac(x), P3 = 32767.
+static void si5351_compute_spread(const si5351_t *si5351, si5351_regmap_t *image)
+{
+    if (si5351->spread == 0) {
+        // Always in the image so it doesn't depend on the shadow - the write is skipped if it's
+        // already off
+        si5351_image_set(image, SI5351_REG_SSC_BASE, 0);
+        return;
+    }
 
-        // Calculate the divider
-        uint32_t omd_div = 0;
-        while ((freq < 500000) && (omd_div < 128)) {
-            omd_div += 1;
-            freq *= 2;
-        }
+    uint32_t a, b, c;
+    si5351_unpack_params(&image->reg[SI5351_REG_MSN_PLL_BASE], &a, &b, &c);
+    uint64_t m = ((uint64_t) a * c) + b;
+    uint32_t ssudp = si5351->desc->crystal_freq / (4 * 31500);
+    uint32_t s = si5351->spread;
+
+    uint32_t dn[3], up[3] = { 0, 0, 1 };
+    uint64_t num = (si5351->spread_center ? 128 : 64) * s * m;
+    uint64_t den = (uint64_t) (10000 + s) * ssudp * c;
+    dn[0] = num / den;
+    dn[1] = ((num % den) * 32767) / den;
+    dn[2] = 32767;
+    if (si5351->spread_center) {
+        den = (uint64_t) (10000 - s) * ssudp * c;
+        up[0] = num / den;
+        up[1] = ((num % den) * 32767) / den;
+        up[2] = 32767;
+    }
+
+    uint8_t reg = SI5351_REG_SSC_BASE;
+    si5351_image_set(image, reg++, 0x80 | ((dn[1] >> 8) & 0x7F));
+    si5351_image_set(image, reg++, dn[1] & 0xFF);
+    si5351_image_set(image, reg++, (si5351->spread_center ? 0x80 : 0) | ((dn[2] >> 8) & 0x7F));
+    si5351_image_set(image, reg++, dn[2] & 0xFF);
+    si5351_image_set(image, reg++, dn[0] & 0xFF);
+    si5351_image_set(image, reg++, ((ssudp >> 4) & 0xF0) | ((dn[0] >> 8) & 0x0F));
+    si5351_image_set(image, reg++, ssudp & 0xFF);
+    si5351_image_set(image, reg++, (up[1] >> 8) & 0x7F);
+    si5351_image_set(image, reg++, up[1] & 0xFF);
+    si5351_image_set(image, reg++, (up[2] >> 8) & 0x7F);
+    si5351_image_set(image, reg++, up[2] & 0xFF);
+    si5351_image_set(image, reg++, up[0] & 0xFF);
+    si5351_image_set(image, reg++, (up[0] >> 8) & 0x0F);
+}
 
-        uint32_t pll[4];
-        si5351_calc_multisynth(si5351, vco_freq, freq, pll);
+// Work out the output multisynth registers for a frequency, in whole Hz plus 1/2^16ths, from a
+// given VCO frequency, as si5351_calc_multisynth().  Sets *ms_int if the multisynth can run
+// in integer mode.
+static int si5351_encode_output(const si5351_t *si5351, uint32_t freq, uint16_t frac, uint32_t vco_freq, uint32_t fixed_den, uint8_t *buf, bool *ms_int)
+{
+    if (freq < SI5351_MIN_FREQ || freq > SI5351_MAX_FREQ) {
+        LOGE("Frequency %lu out of range", freq);
+        return -1;
+    }
+
+    // Calculate the divider
+    uint8_t r_div;
+    freq = si5351_r_scale(freq, &r_div);
+    if (((uint64_t) freq * 8 > vco_freq) || ((uint64_t) freq * 2048 < vco_freq)) {
+        LOGE("Frequency %lu can't be derived from VCO %lu", freq, vco_freq);
+        return -1;
+    }
 
-        // Write the multisynth parameters
-        si5351->write(si5351->dev, SI5351_REG_CLK_SYNTH_BASE + (i * 8), (pll[2] >> 8) & 0xFF);
-        si5351->write(si5351->dev, SI5351_REG_CLK_SYNTH_BASE + (i * 8) + 1, pll[2] & 0xFF);
-        si5351->write(si5351->dev, SI5351_REG_CLK_SYNTH_BASE + (i * 8) + 2, (omd_div << 4) | ((pll[0] >> 16) & 0x03));
-        si5351->write(si5351->dev, SI5351_REG_CLK_SYNTH_BASE + (i * 8) + 3, (pll[0] >> 8) & 0xFF);
-        si5351->write(si5351->dev, SI5351_REG_CLK_SYNTH_BASE + (i * 8) + 4, pll[0] & 0xFF);
-        si5351->write(si5351->dev, SI5351_REG_CLK_SYNTH_BASE + (i * 8) + 5, ((pll[2] >> 12) & 0xF0) | ((pll[1] >> 16) & 0x0F));
-        si5351->write(si5351->dev, SI5351_REG_CLK_SYNTH_BASE + (i * 8) + 6, (pll[1] >> 8) & 0xFF);
-        si5351->write(si5351->dev, SI5351_REG_CLK_SYNTH_BASE + (i * 8) + 7, pll[1] & 0xFF);
+    // Divide in fixed point throughout, so fractions of a Hz are kept
+    uint32_t pll[4];
+    uint64_t freq_q = ((uint64_t) freq << SI5351_FREQ_SHIFT) + ((uint64_t) frac << r_div);
+    *ms_int = si5351_calc_multisynth(si5351, (uint64_t) vco_freq << SI5351_FREQ_SHIFT, freq_q, fixed_den, pll);
+    si5351_pack_params(buf, pll, r_div);
 
-        // Set phase offset
-        si5351->write(si5351->dev, SI5351_REG_PHASE_BASE + i, si5351->phase[i] & 0x7F);
+    return (0);
+}
 
-        // Enable the clock
-        si5351->write(si5351->dev, SI5351_REG_CLK0_CONTROL + i, 
-            ((si5351->pll[i] << 5) & 0x20) | (si5351->clk_invert[i] ? 0x10: 0) | (0x0C) | (si5351->clk_drive[i] & 0x03)); 
+// Work out the divider and R divider for CLK6 or CLK7 from a given VCO frequency.  These have
+// no fractional mode, so the VCO has to be an even multiple of the pre-R frequency.
+static int si5351_encode_integer(const si5351_t *si5351, uint32_t freq, uint16_t frac, uint32_t vco_freq, uint8_t *div, uint8_t *r_div)
+{
+    (void) si5351;                          // Only used for logging
+    if (freq < SI5351_MIN_FREQ || freq > SI5351_MAX_FREQ) {
+        LOGE("Frequency %lu out of range", freq);
+        return -1;
     }
 
-    // Output enables
-    uint8_t oe = 0;
-    for (int i=0; i<SI5351_CLOCKS; i++) {
-        if (si5351->freq[i] == 0) oe |= (1 << i);
+    uint32_t n = (frac == 0) ? si5351_int_divider(vco_freq, si5351_r_scale_int(freq, vco_freq, r_div)) : 0;
+    if (n == 0) {
+        LOGE("Frequency %lu needs an even integer divider from VCO %lu", freq, vco_freq);
+        return -1;
     }
-    si5351->write(si5351->dev, SI5351_REG_OE, oe);
+    *div = n;
 
     return (0);
 }
 
-/* 
- * Initialise the Si5351 driver.  Pass in:
- * - a pointer to the si5351_t struct to initialise
- * - a void* which is passed to the write function (usually the I2C handle for the device)
- * - the crystal frequency (25 or 27MHz)
- * - the crystal load capacitance
- * - a function to write to the device - passed the register to write and the value to which to set it
- * - a function to log debug messages.  Can be null in which case no debug messages will be logged
- */
+// Work out the multisynth, phase and control registers for one output from a given VCO frequency
+static int si5351_compute_output(const si5351_t *si5351, int i, uint32_t vco_freq, si5351_regmap_t *image)
+{
+    if (i >= 6) {
+        // CLK6 and CLK7 share a register for their R dividers, so the other one's is kept from
+        // whatever is already in the image.  They have no phase offset.
+        uint8_t div, r_div;
+        if (si5351_encode_integer(si5351, si5351->freq[i], si5351->freq_frac[i], vco_freq, &div, &r_div) != 0) {
+            return -1;
+        }
+        int shift = (i - 6) * 4;
+        si5351_image_set(image, SI5351_REG_MS6_P1 + (i - 6), div);
+        si5351_image_set(image, SI5351_REG_CLK6_7_R_DIV, (image->reg[SI5351_REG_CLK6_7_R_DIV] & ~(0x07 << shift)) | (r_div << shift));
+        image->ms_int |= (1 << i);
+        si5351_image_set(image, SI5351_REG_CLK0_CONTROL + i, si5351_control(si5351, i, image->fb_int, true, true));
+        return (0);
+    }
 
-void si5351_init(si5351_t *si5351, void *dev, uint32_t cf, si5351_crystal_load_t cl, 
-                    int (*write)(void *dev, uint8_t reg, uint8_t val), void (*log)(const char *fmt, ...))
+    uint8_t buf[SI5351_MS_REGS];
+    bool ms_int;
+    if (si5351_encode_output(si5351, si5351->freq[i], si5351->freq_frac[i], vco_freq, 0, buf, &ms_int) != 0) {
+        return -1;
+    }
+    si5351_image_block(image, SI5351_REG_CLK_SYNTH_BASE + (i * 8), buf);
+    if (ms_int) {
+        image->ms_int |= (1 << i);
+    } else {
+        image->ms_int &= ~(1 << i);
+    }
+
+    // Set phase offset
+    si5351_image_set(image, SI5351_REG_PHASE_BASE + i, si5351->clk[i].phase & 0x7F);
+
+    // Enable the clock
+    si5351_image_set(image, SI5351_REG_CLK0_CONTROL + i, si5351_control(si5351, i, image->fb_int, ms_int, true));
+
+    return (0);
+}
+
+// How good a VCO frequency is for the outputs on a PLL other than its master - the sum of
+// si5351_ratio_score() over them, or -1 if a CLK6 or CLK7 on the PLL can't be divided down from it
+static int si5351_vco_score(const si5351_t *si5351, int pll, uint32_t vco_freq)
 {
-    LOG("Si5351 init %d", sizeof(si5351_t));
+    int score = 0;
+    for (int i=0; i<si5351_outputs(si5351); i++) {
+        if ((si5351->freq[i] == 0) || (si5351->clk[i].pll != pll) || (i == si5351->clk_pll[pll])) continue;
+        if ((si5351->freq[i] < SI5351_MIN_FREQ) || (si5351->freq[i] > SI5351_MAX_FREQ)) continue;
+        uint8_t r_div;
+        if (i >= 6) {
+            if ((si5351->freq_frac[i] != 0) ||
+                (si5351_int_divider(vco_freq, si5351_r_scale_int(si5351->freq[i], vco_freq, &r_div)) == 0)) {
+                return -1;
+            }
+            continue;
+        }
+        // Fractional Hz are never going to give an integer divider
+        if (si5351->freq_frac[i] != 0) continue;
+        score += si5351_ratio_score(vco_freq, si5351_r_scale(si5351->freq[i], &r_div));
+    }
+    return score;
+}
 
-    // Clear device data
-    memset(si5351, 0, sizeof(si5351_t));
+// Pick the VCO frequency for a PLL from its master output's pre-R frequency.  Any even multiple
+// of that in the VCO range will do.  If the PLL is already running at one, it stays there -
+// moving it means a PLL reset and a glitch on every output it drives, and the other outputs
+// are free to be retuned under it.  Otherwise prefer the one which puts the most of the
+// feedback and output multisynths on this PLL into (even) integer mode, for the lowest
+// jitter - AN619.  If nothing beats it, we stay with the lowest even multiple a little above 600MHz.
+static uint32_t si5351_choose_vco(const si5351_t *si5351, int pll, uint32_t freq)
+{
+    uint32_t best = 0;
+    int best_score = -1;
+    uint32_t first = ((SI5351_VCO_MIN / freq) + 3) & ~1;
+    if (first < 8) first = 8;
+    uint32_t last = 2046;
+    if (si5351->clk_pll[pll] >= 6) {
+        // A CLK6 or CLK7 master needs an 8-bit divider
+        first = (((SI5351_VCO_MIN + freq - 1) / freq) + 1) & ~1;
+        if (first < SI5351_INT_DIV_MIN) first = SI5351_INT_DIV_MIN;
+        last = SI5351_INT_DIV_MAX;
+    }
 
-    // Populate
-    si5351->crystal_freq = cf;
-    si5351->crystal_load = cl;
-    si5351->dev = dev;
-    si5351->write = write;
-    si5351->log = log;
+    uint32_t current = si5351->vco_freq[pll];
+    if ((current != 0) && (current <= SI5351_VCO_MAX) && ((current % freq) == 0)) {
+        uint32_t div = current / freq;
+        if (((div & 1) == 0) && (div >= first) && (div <= last) && (si5351_vco_score(si5351, pll, current) >= 0)) {
+            return current;
+        }
+    }
 
-    // Update config on each change
-    si5351->config = 1;
+    for (uint32_t div = first; (div <= last) && ((uint64_t) freq * div <= SI5351_VCO_MAX); div += 2) {
+        uint32_t vco_freq = freq * div;
+        int score = si5351_vco_score(si5351, pll, vco_freq);
+        if (score >= 0) {
+            score += si5351_crystal_score(si5351, vco_freq);
+        }
+        if (score > best_score) {
+            best = vco_freq;
+            best_score = score;
+        }
+    }
 
-    si5351_configure(si5351);
+    return best;
+}
+
+// Is this output the one its PLL's VCO frequency is derived from?
+static bool si5351_is_master(const si5351_t *si5351, int output)
+{
+    si5351_PLL_t pll = (si5351_PLL_t) si5351->clk[output].pll;
+    return (si5351->vco_fixed[pll] == 0) && (si5351->clk_pll[pll] == output);
+}
+
+// Output disable states - CLK4-7 only if the part has them
+static void si5351_compute_disable(const si5351_t *si5351, si5351_regmap_t *image)
+{
+    si5351_image_set(image, SI5351_REG_CLK3_0_DISABLE_STATE, 
+        (si5351->clk[3].disable << 6) | (si5351->clk[2].disable << 4) | (si5351->clk[1].disable << 2) | si5351->clk[0].disable);
+    if (si5351_outputs(si5351) > 4) {
+        si5351_image_set(image, SI5351_REG_CLK7_4_DISABLE_STATE, 
+            (si5351->clk[7].disable << 6) | (si5351->clk[6].disable << 4) | (si5351->clk[5].disable << 2) | si5351->clk[4].disable);
+    }
 }
 
 /*
- * Set up a clock output.  Pass in:
+ * Work out the complete register image for the current configuration.  Pass in:
  * - a pointer to the si5351_t struct
- * - the output to be set
- * - which PLL it should be derived from
- * - the desired frequency
- * - the desired phase
- * - whether the clock should be inverted   
- * - whether this channel should be used to derive the PLL frequency
-*/
+ * - the register map to fill in
+ * Nothing is written to the chip and the driver state isn't changed, so this can run anywhere,
+ * and a configuration which fails validation never leaves the device half-programmed.  The
+ * map can be kept and sent later with si5351_apply().
+ */
 
-int si5351_set(si5351_t *si5351, uint8_t output, si5351_PLL_t pll, uint32_t freq, uint32_t phase, bool invert, bool pll_master)
+static int si5351_compute_image(const si5351_t *si5351, si5351_regmap_t *image)
 {
-    // Validate inputs
-    if (output >= SI5351_CLOCKS) {
-        LOG("Clock output out of range");
-        return -1;
+    int outputs = si5351_outputs(si5351);
+    memset(image, 0, sizeof(si5351_regmap_t));
+
+    // Set output disable state
+    si5351_compute_disable(si5351, image);
+
+    // Set crystal load capacitance
+    si5351_image_set(image, SI5351_REG_CRYSTAL_INTERNAL_LOAD_CAPACITANCE, 0x48 | si5351->desc->crystal_load);
+
+    // Calculate VCO frequencies for the PLLs which are in use
+    for (int i=0; i<SI5351_PLLS; i++) {
+        bool in_use = false;
+        for (int j=0; j<outputs; j++) {
+            if ((si5351->freq[j] != 0) && (si5351->clk[j].pll == i)) in_use = true;
+        }
+        if (!in_use) continue;
+
+        uint32_t vco_freq = si5351->vco_fixed[i];
+        if (vco_freq != 0) {
+            // Set by si5351_set_vco() or si5351_plan()
+            if ((vco_freq < SI5351_VCO_MIN) || (vco_freq > SI5351_VCO_MAX)) {
+                LOGE("VCO frequency %lu out of range", vco_freq);
+                return -1;
+            }
+        } else {
+            // Calculate a sensible VCO frequency - even multiple of target, in the range 600-900MHz
+            if (si5351->clk_pll[i] >= outputs) {
+                LOGE("Clock %d out of range for PLL %d", si5351->clk_pll[i], i);
+                return -1;
+            }
+            uint32_t freq = si5351->freq[si5351->clk_pll[i]];
+            if ((freq < SI5351_MIN_FREQ) || (freq > SI5351_MAX_FREQ)) {
+                LOGE("Frequency %lu out of range", freq);
+                return -1;
+            } 
+
+            uint8_t vco_ri;
+            uint32_t scaled = (si5351->clk_pll[i] >= 6) ? si5351_r_scale_int(freq, SI5351_VCO_MAX, &vco_ri) : si5351_r_scale(freq, &vco_ri);
+            vco_freq = si5351_choose_vco(si5351, i, scaled);
+            if (vco_freq == 0) {
+                LOGE("No VCO frequency available for %lu", freq);
+                return -1;
+            }
+        }
+        image->vco_freq[i] = vco_freq;
+        si5351_compute_feedback(si5351, i, vco_freq, image);
+        if (i == SI5351_PLL_A) {
+            si5351_compute_spread(si5351, image);
+        }
+        LOGD("PLL %d VCO %lu, feedback %s", i, vco_freq, (image->fb_int & (1 << i)) ? "integer" : "fractional");
     }
 
-    si5351->freq[output] = freq;
-    si5351->phase[output] = phase;
-    si5351->clk_invert[output] = invert;
-    si5351->pll[output] = pll;
-    if (pll_master) {
-        si5351->clk_pll[pll] = output;
-        LOG("PLL %d is master for clock %d - %d", pll, output, si5351->clk_pll[pll]);
+    // Set clock frequencies - only for the outputs the part has
+    for (int i=0; i<outputs; i++) {
+        LOGD("Clock %d freq %ld", i, si5351->freq[i]);
+        if (si5351->freq[i] == 0) {
+            // Unused clocks are powered down
+            si5351_image_set(image, SI5351_REG_CLK0_CONTROL + i, si5351_control(si5351, i, image->fb_int, false, false));
+            continue;
+        }
+
+        if (si5351_compute_output(si5351, i, image->vco_freq[si5351->clk[i].pll], image) != 0) {
+            return -1;
+        }
+        LOGD("Clock %d multisynth %s", i, (image->ms_int & (1 << i)) ? "integer" : "fractional");
     }
 
-    return (si5351_configure(si5351));
+    // Output enables
+    uint8_t oe = 0;
+    for (int i=0; i<SI5351_CLOCKS; i++) {
+        if ((i >= outputs) || (si5351->freq[i] == 0)) oe |= (1 << i);
+    }
+    si5351_image_set(image, SI5351_REG_OE, oe);
+
+    return (0);
 }
 
-// Don't update after each change - useful if we're making a bunch of changes at once
-void si5351_start_batch(si5351_t *si5351)
+static int si5351_compute_locked(const si5351_t *si5351, si5351_regmap_t *image)
 {
-    si5351->config = 0;
-}   
+    EVENT(SI5351_EVENT_COMPUTE_START);
+    int ret = si5351_compute_image(si5351, image);
+    STATS_ADD(computes, 1);
+    EVENT(SI5351_EVENT_COMPUTE_END);
+    return ret;
+}
 
-// Update the Si5351 with the new configuration
-void si5351_write_batch(si5351_t *si5351)
+int si5351_compute(const si5351_t *si5351, si5351_regmap_t *image)
 {
-    si5351->config = 1;
-    si5351_configure(si5351);
+    LOCK();
+    int ret = si5351_compute_locked(si5351, image);
+    UNLOCK();
+    return ret;
 }
 
-// Set output disabled state for a specific output or for all channels
-int si5351_set_disabled(si5351_t *si5351, int clock, si5351_disable_t ds)
+// Does this register in the image differ from what the chip holds?
+static bool si5351_dirty(const si5351_t *si5351, const si5351_regmap_t *image, uint8_t reg)
 {
-    if (clock == SI5351_CLOCK_ALL) {
-        for (int i=0; i<SI5351_CLOCKS; i++) {
-            si5351->clk_dis[i] = ds;
+    return si5351_image_used(image, reg) && 
+        (!si5351_shadow_valid(si5351, reg) || (si5351->shadow[reg] != image->reg[reg]));
+}
+
+static void si5351_shadow_update(si5351_t *si5351, uint8_t reg, const uint8_t *buf, size_t len, bool ok)
+{
+    for (size_t i=0; i<len; i++, reg++) {
+        if (ok && (reg != SI5351_REG_PLL_RESET)) {
+            si5351->shadow[reg] = buf[i];
+            si5351->shadow_valid[reg >> 3] |= (1 << (reg & 7));
+        } else {
+            // We no longer know what the chip holds
+            si5351->shadow_valid[reg >> 3] &= ~(1 << (reg & 7));
         }
+    }
+}
+
+// Queue a run of registers on a transaction list.  The shadow is updated straight away and
+// put right by si5351_async_done() if the transfer fails.
+static void si5351_queue_regs(si5351_t *si5351, si5351_txlist_t *list, uint8_t reg, const uint8_t *buf, size_t len)
+{
+    if ((list->count >= SI5351_TX_MAX) || (list->used + len > sizeof(list->data))) {
+        list->overflow = true;
+        return;
+    }
+    uint8_t *data = &list->data[list->used];
+    memcpy(data, buf, len);
+    list->tx[list->count].reg = reg;
+    list->tx[list->count].len = len;
+    list->tx[list->count].data = data;
+    list->count++;
+    list->used += len;
+    STATS_ADD(transactions, 1);
+    STATS_ADD(bytes, len);
+    si5351_shadow_update(si5351, reg, buf, len, true);
+}
+
+// Forget everything on a transaction list - we don't know which of it reached the chip
+static void si5351_txlist_invalidate(si5351_t *si5351, const si5351_txlist_t *list)
+{
+    for (size_t i=0; i<list->count; i++) {
+        si5351_shadow_update(si5351, list->tx[i].reg, list->tx[i].data, list->tx[i].len, false);
+    }
+}
+
+// One bus transaction - a block write if there's more than one register
+static bool si5351_bus_write(si5351_t *si5351, uint8_t reg, const uint8_t *buf, size_t len)
+{
+    bool ok;
+    if (len > 1) {
+        ok = si5351->desc->write_block(si5351->dev, reg, buf, len) == 0;
     } else {
-        if ((clock >= 0) && (clock < SI5351_CLOCKS)) {
-            si5351->clk_dis[clock] = ds;
-        } else {
-            LOG("Clock %d invalid", clock);
-            return -1;
+        ok = si5351->desc->write(si5351->dev, reg, buf[0]) == 0;
+    }
+    STATS_ADD(transactions, 1);
+    STATS_ADD(bytes, len);
+    STATS_ADD(write_errors, ok ? 0 : 1);
+    return ok;
+}
+
+// Write a run of registers in pieces of up to chunk registers, making up to attempts tries at
+// each.  The pieces are lined up with the multisynth blocks at 26 + 8k, so a run which starts
+// part way into one never has a piece straddling two.  Only the pieces which still fail are
+// marked as unknown in the shadow.
+static int si5351_write_pieces(si5351_t *si5351, uint8_t reg, const uint8_t *buf, size_t len, size_t chunk, int attempts)
+{
+    int ret = 0;
+    size_t n;
+    for (size_t i=0; i<len; i+=n) {
+        size_t offset = (reg + i + chunk - (SI5351_REG_MSN_PLL_BASE % chunk)) % chunk;
+        n = chunk - offset;
+        if (n > len - i) n = len - i;
+        bool ok = false;
+        for (int attempt=0; !ok && (attempt < attempts); attempt++) {
+            ok = si5351_bus_write(si5351, reg + i, &buf[i], n);
+        }
+        si5351_shadow_update(si5351, reg + i, &buf[i], n, ok);
+        if (!ok) {
+            LOGE("Write of %d registers at %d failed", n, reg + i);
+            ret = -1;
         }
     }
-    si5351_configure(si5351);
-    return 0;
+    return ret;
+}
+
+// Write a run of consecutive registers, as a single transaction if we can, or add it to a
+// transaction list if we're building one.  A failed block write could have stopped anywhere,
+// so it's retried a multisynth's worth of registers at a time, and a failed single register
+// write is retried on its own.  Returns -1 if anything still couldn't be written.
+static int si5351_write_regs(si5351_t *si5351, si5351_txlist_t *list, uint8_t reg, const uint8_t *buf, size_t len)
+{
+    if (list != NULL) {
+        si5351_queue_regs(si5351, list, reg, buf, len);
+        return 0;
+    }
+    if ((si5351->desc->write_block == NULL) || (len == 1)) {
+        return si5351_write_pieces(si5351, reg, buf, len, 1, 1 + si5351->retries);
+    }
+    if (si5351_bus_write(si5351, reg, buf, len)) {
+        si5351_shadow_update(si5351, reg, buf, len, true);
+        return 0;
+    }
+    if (si5351->retries != 0) {
+        return si5351_write_pieces(si5351, reg, buf, len, SI5351_MS_REGS, si5351->retries);
+    }
+    LOGE("Write of %d registers at %d failed", len, reg);
+    si5351_shadow_update(si5351, reg, buf, len, false);
+    return -1;
+}
+
+// Write a register via the shadow copy - nothing goes on the bus if the chip already holds the value
+static int si5351_write_reg(si5351_t *si5351, si5351_txlist_t *list, uint8_t reg, uint8_t val)
+{
+    if (si5351_shadow_valid(si5351, reg) && (si5351->shadow[reg] == val)) {
+        return 0;
+    }
+    return si5351_write_regs(si5351, list, reg, &val, 1);
+}
+
+// Write every register in the image which differs from the chip, apart from the output enables.
+// Changed registers are grouped into runs - with block writes, a short gap of unchanged
+// registers is cheaper to rewrite than to start a new transaction for.  Without them every
+// register is its own transaction anyway, so runs stop at the first unchanged one.  Everything
+// is tried even if a write fails, and -1 returned at the end; the registers which failed are
+// left marked as unknown in the shadow, so the next configure rewrites just those.
+static int si5351_write_dirty(si5351_t *si5351, si5351_txlist_t *list, const si5351_regmap_t *image)
+{
+    int gap = (si5351->desc->write_block != NULL) ? SI5351_RUN_GAP : 0;
+    int ret = 0;
+    int reg = 0;
+    while (reg < SI5351_REGISTERS) {
+        if ((reg == SI5351_REG_OE) || !si5351_dirty(si5351, image, reg)) {
+            reg++;
+            continue;
+        }
+        int end = reg + 1;
+        for (int next = end; (next < SI5351_REGISTERS) && (next != SI5351_REG_OE) && si5351_image_used(image, next); next++) {
+            if (si5351_dirty(si5351, image, next)) {
+                end = next + 1;
+            } else if (next - end >= gap) {
+                break;
+            }
+        }
+        if (si5351_write_regs(si5351, list, reg, &image->reg[reg], end - reg) != 0) {
+            ret = -1;
+        }
+        reg = end;
+    }
+    return ret;
+}
+
+static bool si5351_range_dirty(const si5351_t *si5351, const si5351_regmap_t *image, int base, int len)
+{
+    for (int reg=base; reg<base + len; reg++) {
+        if (si5351_dirty(si5351, image, reg)) return true;
+    }
+    return false;
+}
+
+// First half of si5351_send() - gate the affected outputs off and write the changed registers.
+// Sets *pll_reset to the PLLs which need a reset, and returns -1 if a write failed.
+static int si5351_send_regs(si5351_t *si5351, si5351_txlist_t *list, const si5351_regmap_t *image, uint8_t *pll_reset_out)
+{
+    // Work out which PLLs are being reprogrammed, or need resetting anyway to line up output phases
+    uint8_t pll_reset = si5351->reset_pll;
+    si5351->reset_pll = 0;
+    for (int i=0; i<SI5351_PLLS; i++) {
+        if (si5351_range_dirty(si5351, image, SI5351_REG_MSN_PLL_BASE + (i * 8), SI5351_MS_REGS)) {
+            pll_reset |= (i == SI5351_PLL_A) ? SI5351_PLL_RESET_A : SI5351_PLL_RESET_B;
+        }
+    }
+
+    // Work out which outputs to disable while they're being reprogrammed.  Normally that's all of
+    // them if anything changes; in glitch-free mode it's only outputs on a PLL which is changing
+    // or which are being switched on, off or over to the other PLL.
+    uint8_t gate = 0;
+    if (si5351->glitch_free) {
+        for (int i=0; i<si5351_outputs(si5351); i++) {
+            bool enabled = !(image->reg[SI5351_REG_OE] & (1 << i));
+            uint8_t reset = (image->reg[SI5351_REG_CLK0_CONTROL + i] & 0x20) ? SI5351_PLL_RESET_B : SI5351_PLL_RESET_A;
+            if ((enabled && (pll_reset & reset)) || 
+                si5351_dirty(si5351, image, SI5351_REG_CLK0_CONTROL + i)) {
+                gate |= (1 << i);
+            }
+        }
+    } else {
+        for (int reg=0; reg<SI5351_REGISTERS; reg++) {
+            if ((reg != SI5351_REG_OE) && si5351_dirty(si5351, image, reg)) gate = 0xFF;
+        }
+    }
+
+    int ret = 0;
+    if (gate != 0) {
+        uint8_t oe = si5351_shadow_valid(si5351, SI5351_REG_OE) ? si5351->shadow[SI5351_REG_OE] : 0xFF;
+        ret = si5351_write_reg(si5351, list, SI5351_REG_OE, oe | gate);
+    }
+
+    if (si5351_write_dirty(si5351, list, image) != 0) {
+        ret = -1;
+    }
+    *pll_reset_out = pll_reset;
+    return ret;
+}
+
+// Second half of si5351_send() - reset the PLLs and switch the outputs back on
+static int si5351_send_finish(si5351_t *si5351, si5351_txlist_t *list, const si5351_regmap_t *image, uint8_t pll_reset)
+{
+    int ret = 0;
+
+    // A PLL needs a soft reset after its parameters change - AN619.  If that doesn't get
+    // through, send it again next time.
+    if ((pll_reset != 0) && (si5351_write_regs(si5351, list, SI5351_REG_PLL_RESET, &pll_reset, 1) != 0)) {
+        si5351->reset_pll |= pll_reset;
+        ret = -1;
+    }
+
+    // Output enables
+    if (si5351_write_reg(si5351, list, SI5351_REG_OE, image->reg[SI5351_REG_OE]) != 0) {
+        ret = -1;
+    }
+
+    if ((list != NULL) && list->overflow) {
+        LOGE("Transaction list full");
+        si5351_txlist_invalidate(si5351, list);
+        return -1;
+    }
+
+    return ret;
+}
+
+// Send a register image to the chip, writing only the registers which have changed.  If list
+// isn't NULL, the writes are added to it rather than being sent.  Returns -1 if any write
+// failed, after retrying - the rest of the image is still sent.
+static int si5351_send(si5351_t *si5351, si5351_txlist_t *list, const si5351_regmap_t *image)
+{
+    uint8_t pll_reset;
+    int ret = si5351_send_regs(si5351, list, image, &pll_reset);
+    if (si5351_send_finish(si5351, list, image, pll_reset) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+// Take on the derived state which goes with a register map
+static void si5351_adopt(si5351_t *si5351, const si5351_regmap_t *image)
+{
+    memcpy(si5351->vco_freq, image->vco_freq, sizeof(si5351->vco_freq));
+    si5351->fb_int = image->fb_int;
+    si5351->ms_int = image->ms_int;
+    // A full image includes any retunes made during the batch
+    si5351->staged = 0;
+}
+
+/*
+ * Send a register map from si5351_compute() to the chip.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - the register map
+ * Only registers which differ from what the chip holds are written.  The driver's record of
+ * the VCO frequencies and integer modes is updated from the map; the requested settings
+ * (frequencies, PLL assignments and so on) are not.
+ */
+
+static int si5351_apply_locked(si5351_t *si5351, const si5351_regmap_t *map)
+{
+    if (si5351->pending != NULL) {
+        LOGE("Transfer in progress");
+        return -1;
+    }
+
+    si5351_adopt(si5351, map);
+    EVENT(SI5351_EVENT_APPLY_START);
+    int ret = si5351_send(si5351, NULL, map);
+    EVENT(SI5351_EVENT_APPLY_END);
+    return ret;
+}
+
+int si5351_apply(si5351_t *si5351, const si5351_regmap_t *map)
+{
+    LOCK();
+    int ret = si5351_apply_locked(si5351, map);
+    UNLOCK();
+    return ret;
+}
+
+// Just the output control and disable state registers, from the current PLL setup, and the
+// multisynths of the outputs retuned during a batch
+static void si5351_compute_controls(const si5351_t *si5351, si5351_regmap_t *image)
+{
+    memset(image, 0, sizeof(si5351_regmap_t));
+    memcpy(image->vco_freq, si5351->vco_freq, sizeof(image->vco_freq));
+    image->fb_int = si5351->fb_int;
+    image->ms_int = (si5351->ms_int & ~si5351->staged) | (si5351->staged_int & si5351->staged);
+    si5351_compute_disable(si5351, image);
+    for (int i=0; i<si5351_outputs(si5351); i++) {
+        si5351_image_set(image, SI5351_REG_CLK0_CONTROL + i, 
+            si5351_control(si5351, i, si5351->fb_int, (image->ms_int & (1 << i)) != 0, si5351->freq[i] != 0));
+    }
+
+    // CLK6 and CLK7 keep the other output's half of the shared R divider register, which
+    // si5351_retune() has made sure is known
+    image->reg[SI5351_REG_CLK6_7_R_DIV] = si5351->shadow[SI5351_REG_CLK6_7_R_DIV];
+    for (int i=0; i<si5351_outputs(si5351); i++) {
+        if (!(si5351->staged & (1 << i))) continue;
+        const uint8_t *buf = si5351->staged_reg[i];
+        if (i >= 6) {
+            int shift = (i - 6) * 4;
+            si5351_image_set(image, SI5351_REG_MS6_P1 + (i - 6), buf[0]);
+            si5351_image_set(image, SI5351_REG_CLK6_7_R_DIV, (image->reg[SI5351_REG_CLK6_7_R_DIV] & ~(0x07 << shift)) | (buf[1] << shift));
+        } else {
+            si5351_image_block(image, SI5351_REG_CLK_SYNTH_BASE + (i * 8), buf);
+        }
+    }
+}
+
+// Configure SI5351 - only as much as has changed
+static int si5351_configure(si5351_t *si5351)
+{
+    // Check if we're in config mode..
+    if (!si5351->config || (si5351->changed == 0)) {
+        return 0;
+    }
+    STATS_ADD(configures, 1);
+
+    si5351_regmap_t map;
+    if (si5351->changed & SI5351_CHANGED_CONFIG) {
+        if ((si5351_compute_locked(si5351, &map) != 0) || (si5351_apply_locked(si5351, &map) != 0)) {
+            return -1;
+        }
+    } else {
+        // Drive and disable states, and retunes of outputs which aren't their PLL's master, can
+        // change under a running output - no need to touch the PLLs or gate anything off
+        if (si5351->pending != NULL) {
+            LOGE("Transfer in progress");
+            return -1;
+        }
+        si5351_compute_controls(si5351, &map);
+        EVENT(SI5351_EVENT_APPLY_START);
+        int ret = si5351_write_dirty(si5351, NULL, &map);
+        EVENT(SI5351_EVENT_APPLY_END);
+        if (ret != 0) {
+            return -1;
+        }
+        si5351->ms_int = map.ms_int;
+        si5351->staged = 0;
+    }
+
+    si5351->changed = 0;
+    return (0);
+}
+
+#ifndef SI5351_CONST_DESC
+// The driver's own copy of its descriptor, for the setters to change - taken from the one it
+// was initialised with if that was passed in
+static si5351_desc_t *si5351_own_desc(si5351_t *si5351)
+{
+    if (si5351->desc != &si5351->own_desc) {
+        si5351->own_desc = *si5351->desc;
+        si5351->desc = &si5351->own_desc;
+    }
+    return &si5351->own_desc;
+}
+#endif
+
+// Common to both ways of initialising the driver
+static void si5351_start(si5351_t *si5351)
+{
+    LOGD("Si5351 init %d", sizeof(si5351_t));
+
+    // Update config on each change
+    si5351->config = 1;
+    si5351->changed = SI5351_CHANGED_CONFIG;
+    si5351->retries = SI5351_WRITE_RETRIES;
+
+    si5351_configure(si5351);
+}
+
+/*
+ * Initialise the Si5351 driver from a descriptor, which can be const and live in flash.  Pass in:
+ * - a pointer to the si5351_t struct to initialise
+ * - a void* which is passed to the write function (usually the I2C handle for the device)
+ * - the descriptor - crystal and callbacks - which must stay valid as long as the driver is used
+ */
+
+void si5351_init_desc(si5351_t *si5351, void *dev, const si5351_desc_t *desc)
+{
+    // Clear device data
+    memset(si5351, 0, sizeof(si5351_t));
+
+    si5351->dev = dev;
+    si5351->desc = desc;
+    si5351_start(si5351);
+}
+
+// Initialise the driver after a reset of the processor alone, when the Si5351 may still be
+// running from its last configuration.  As si5351_init_desc(), but nothing is sent to the
+// chip.  Set the outputs up in a batch, and finish it with si5351_warm_boot().
+void si5351_init_warm(si5351_t *si5351, void *dev, const si5351_desc_t *desc)
+{
+    memset(si5351, 0, sizeof(si5351_t));
+
+    si5351->dev = dev;
+    si5351->desc = desc;
+    si5351->config = 1;
+    si5351->changed = SI5351_CHANGED_CONFIG;
+    si5351->retries = SI5351_WRITE_RETRIES;
+}
+
+#ifndef SI5351_CONST_DESC
+/* 
+ * Initialise the Si5351 driver.  Pass in:
+ * - a pointer to the si5351_t struct to initialise
+ * - a void* which is passed to the write function (usually the I2C handle for the device)
+ * - the crystal frequency (25 or 27MHz)
+ * - the crystal load capacitance
+ * - which part it is, which sets the outputs it has - nothing is sent for outputs it doesn't
+ * - a function to write to the device - passed the register to write and the value to which to set it
+ * - a function to log debug messages.  Can be null in which case no debug messages will be logged
+ * The descriptor is kept in the si5351_t struct, so the callbacks can be changed later.
+ */
+
+void si5351_init(si5351_t *si5351, void *dev, uint32_t cf, si5351_crystal_load_t cl, si5351_variant_t variant,
+                    int (*write)(void *dev, uint8_t reg, uint8_t val), void (*log)(const char *fmt, ...))
+{
+    // Clear device data
+    memset(si5351, 0, sizeof(si5351_t));
+
+    // Populate
+    si5351->own_desc.crystal_freq = cf;
+    si5351->own_desc.crystal_load = cl;
+    si5351->own_desc.variant = variant;
+    si5351->own_desc.write = write;
+    si5351->own_desc.log = log;
+    si5351->desc = &si5351->own_desc;
+    si5351->dev = dev;
+    si5351_start(si5351);
+}
+#endif
+
+/*
+ * Set up a clock output.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - the output to be set
+ * - which PLL it should be derived from
+ * - the desired frequency
+ * - the desired phase
+ * - whether the clock should be inverted   
+ * - whether this channel should be used to derive the PLL frequency
+*/
+
+static int si5351_set_locked(si5351_t *si5351, uint8_t output, si5351_PLL_t pll, uint32_t freq, uint32_t phase, bool invert, bool pll_master)
+{
+    // Validate inputs
+    if (!si5351_output_valid(si5351, output)) {
+        LOGE("Clock output out of range");
+        return -1;
+    }
+    if ((phase > SI5351_PHASE_MAX) || ((output >= 6) && (phase != 0))) {
+        LOGE("Phase %lu out of range", phase);
+        return -1;
+    }
+    if (pll >= SI5351_PLLS) {
+        LOGE("PLL %d out of range", pll);
+        return -1;
+    }
+
+    si5351->freq[output] = freq;
+    si5351->freq_frac[output] = 0;
+    si5351->clk[output].phase = phase;
+    si5351->clk[output].invert = invert;
+    si5351->clk[output].pll = pll;
+    if (pll_master) {
+        si5351->clk_pll[pll] = output;
+        si5351->vco_fixed[pll] = 0;
+        LOGD("PLL %d is master for clock %d - %d", pll, output, si5351->clk_pll[pll]);
+    }
+    si5351->changed |= SI5351_CHANGED_CONFIG;
+
+    return (si5351_configure(si5351));
+}
+
+int si5351_set(si5351_t *si5351, uint8_t output, si5351_PLL_t pll, uint32_t freq, uint32_t phase, bool invert, bool pll_master)
+{
+    LOCK();
+    int ret = si5351_set_locked(si5351, output, pll, freq, phase, invert, pll_master);
+    UNLOCK();
+    return ret;
+}
+
+/*
+ * Set the frequency of an output to a fraction of a Hz.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - the output, already set up with si5351_set() - its PLL, phase, inversion and master
+ *   setting are kept
+ * - the frequency in Hz * 2^SI5351_FREQ_SHIFT - SI5351_FREQ_Q(hz) converts whole Hz
+ * - where to put the frequency the output will actually run at, in the same units - can be NULL
+ * - where to put the difference between that and the requested frequency - can be NULL
+ * Everything from the VCO to the output divider is worked out in integer arithmetic, so the
+ * only error is the limit of the chip's 20-bit fractional dividers.  The achieved frequency is
+ * reported even within a batch, before anything is written.
+ */
+
+static int si5351_set_freq_q_locked(si5351_t *si5351, uint8_t output, uint64_t freq_q, uint64_t *actual_q, int64_t *error_q)
+{
+    if (!si5351_output_valid(si5351, output)) {
+        LOGE("Clock output out of range");
+        return -1;
+    }
+    // Checked before it's cut down to the 32-bit whole Hz, which would wrap
+    if ((freq_q < ((uint64_t) SI5351_MIN_FREQ << SI5351_FREQ_SHIFT)) || (freq_q > ((uint64_t) SI5351_MAX_FREQ << SI5351_FREQ_SHIFT))) {
+        LOGE("Frequency %llu/65536 out of range", freq_q);
+        return -1;
+    }
+
+    si5351->freq[output] = freq_q >> SI5351_FREQ_SHIFT;
+    si5351->freq_frac[output] = freq_q & ((1 << SI5351_FREQ_SHIFT) - 1);
+    si5351->changed |= SI5351_CHANGED_CONFIG;
+
+    si5351_regmap_t map;
+    if (si5351_compute_locked(si5351, &map) != 0) {
+        return -1;
+    }
+    uint64_t actual = si5351_decode_freq(si5351, map.reg, output);
+    if (actual_q != NULL) *actual_q = actual;
+    if (error_q != NULL) *error_q = (int64_t) (actual - freq_q);
+
+    if (!si5351->config) {
+        return 0;
+    }
+    if (si5351_apply_locked(si5351, &map) != 0) {
+        return -1;
+    }
+    si5351->changed = 0;
+    return (0);
+}
+
+int si5351_set_freq_q(si5351_t *si5351, uint8_t output, uint64_t freq_q, uint64_t *actual_q, int64_t *error_q)
+{
+    LOCK();
+    int ret = si5351_set_freq_q_locked(si5351, output, freq_q, actual_q, error_q);
+    UNLOCK();
+    return ret;
+}
+
+// Can an even integer output divider n give this frequency from a VCO in range, with the phase
+// offset fitting in the phase register?  The offset is in quarter VCO periods, so it's
+// 4n * degrees / 360, which is exact if that comes out whole.
+static bool si5351_phase_fits(uint32_t freq, uint16_t degrees, uint32_t n, uint8_t *phase, bool *exact)
+{
+    uint64_t vco_freq = (uint64_t) freq * n;
+    uint32_t q = 4 * n * degrees;
+    if ((vco_freq < SI5351_VCO_MIN) || (vco_freq > SI5351_VCO_MAX) || (((q + 180) / 360) > SI5351_PHASE_MAX)) {
+        return false;
+    }
+    *phase = (q + 180) / 360;
+    *exact = (q % 360) == 0;
+    return true;
+}
+
+// Pick the divider for a phase offset pair - one to keep if it still works, so the pair can be
+// retuned by moving the VCO alone, otherwise the smallest which makes the offset exact, otherwise
+// the smallest which gets near it.  Returns 0 if there's nothing suitable.
+static uint32_t si5351_phase_divider(uint32_t freq, uint16_t degrees, uint32_t keep, uint8_t *phase)
+{
+    bool exact;
+    if ((keep != 0) && si5351_phase_fits(freq, degrees, keep, phase, &exact)) {
+        return keep;
+    }
+
+    uint32_t best = 0;
+    uint8_t best_phase = 0;
+    uint32_t first = (((SI5351_VCO_MIN + freq - 1) / freq) + 1) & ~1;
+    for (uint32_t n = first; n <= 2046; n += 2) {
+        // The offset only gets bigger with the divider, so stop at the first one which doesn't fit
+        if (!si5351_phase_fits(freq, degrees, n, phase, &exact)) break;
+        if (exact) return n;
+        if (best == 0) {
+            best = n;
+            best_phase = *phase;
+        }
+    }
+    *phase = best_phase;
+    return best;
+}
+
+/*
+ * Set up a pair of outputs at the same frequency with a phase offset between them, such as
+ * the I and Q local oscillators of an SDR.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - the reference output and the offset output
+ * - the PLL to run them from, which is given over to the pair - any other output on it has to
+ *   work with whatever VCO frequency the pair needs
+ * - the frequency, in a range where the output R divider isn't needed (500kHz upwards) and
+ *   low enough that the offset fits in the phase register - about 4.7MHz upwards for 90 degrees
+ * - the offset, in degrees (90 for quadrature)
+ * Both outputs get the same even integer divider, which puts them in integer mode and makes
+ * the offset exact where the divider allows it.  The PLL is reset afterwards, which is what
+ * lines the phases up.  Calling it again for the pair keeps the divider if it can, so that
+ * retuning only moves the VCO.
+ */
+
+static int si5351_set_quadrature_locked(si5351_t *si5351, uint8_t out_i, uint8_t out_q, si5351_PLL_t pll, uint32_t freq, uint16_t degrees)
+{
+    if (!si5351_output_valid(si5351, out_i) || !si5351_output_valid(si5351, out_q) || (out_i == out_q)) {
+        LOGE("Clock output out of range");
+        return -1;
+    }
+    if ((out_i >= 6) || (out_q >= 6)) {
+        LOGE("Clock %d has no phase offset", (out_i >= 6) ? out_i : out_q);
+        return -1;
+    }
+    if (pll >= SI5351_PLLS) {
+        LOGE("PLL %d out of range", pll);
+        return -1;
+    }
+    if ((freq < 500000) || (freq > SI5351_MAX_FREQ)) {
+        LOGE("Frequency %lu out of range", freq);
+        return -1;
+    }
+
+    // Keep the divider we're already using if this pair is already set up
+    uint32_t keep = 0;
+    if ((si5351->clk[out_i].pll == pll) && (si5351->clk[out_q].pll == pll) && (si5351->freq[out_i] != 0) &&
+        (si5351->vco_freq[pll] != 0) && ((si5351->vco_freq[pll] % si5351->freq[out_i]) == 0)) {
+        keep = si5351->vco_freq[pll] / si5351->freq[out_i];
+        if (keep & 1) keep = 0;
+    }
+
+    uint8_t phase;
+    uint32_t n = si5351_phase_divider(freq, degrees % 360, keep, &phase);
+    if (n == 0) {
+        LOGE("No divider gives %d degrees at %lu", degrees, freq);
+        return -1;
+    }
+    LOGD("Phase pair %d/%d divider %lu, phase %d", out_i, out_q, n, phase);
+
+    uint8_t outputs[2] = { out_i, out_q };
+    for (int i=0; i<2; i++) {
+        si5351->freq[outputs[i]] = freq;
+        si5351->freq_frac[outputs[i]] = 0;
+        si5351->clk[outputs[i]].pll = pll;
+    }
+    si5351->clk[out_i].phase = 0;
+    si5351->clk[out_q].phase = phase;
+    si5351->vco_fixed[pll] = freq * n;
+    si5351->reset_pll |= (pll == SI5351_PLL_A) ? SI5351_PLL_RESET_A : SI5351_PLL_RESET_B;
+    si5351->changed |= SI5351_CHANGED_CONFIG;
+
+    return (si5351_configure(si5351));
+}
+
+int si5351_set_quadrature(si5351_t *si5351, uint8_t out_i, uint8_t out_q, si5351_PLL_t pll, uint32_t freq, uint16_t degrees)
+{
+    LOCK();
+    int ret = si5351_set_quadrature_locked(si5351, out_i, out_q, pll, freq, degrees);
+    UNLOCK();
+    return ret;
+}
+
+/*
+ * Change the frequency of a running output without touching its PLL.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - the output to be retuned
+ * - the new frequency
+ * The output must already be enabled and must not be the master for its PLL.  Only the
+ * output's multisynth is recalculated, from the current VCO frequency, and only its
+ * changed registers are written - the other outputs are left running.  During a batch the
+ * registers are worked out straight away and kept, and the batch sends just those unless
+ * something else in it needs the whole configuration working out again.
+ */
+
+static int si5351_retune_locked(si5351_t *si5351, uint8_t output, uint32_t freq)
+{
+    if (si5351->pending != NULL) {
+        LOGE("Transfer in progress");
+        return -1;
+    }
+    if (!si5351_output_valid(si5351, output)) {
+        LOGE("Clock output out of range");
+        return -1;
+    }
+
+    si5351_PLL_t pll = (si5351_PLL_t) si5351->clk[output].pll;
+    if ((si5351->freq[output] == 0) || (pll >= SI5351_PLLS) || (si5351->vco_freq[pll] == 0)) {
+        LOGE("Clock %d is not running", output);
+        return -1;
+    }
+    if (si5351_is_master(si5351, output)) {
+        LOGE("Clock %d is master for PLL %d", output, pll);
+        return -1;
+    }
+
+    // Worked out straight away, even during a batch, so a frequency the VCO can't reach is
+    // refused now, and sending it is just a matter of writing the registers
+    uint8_t buf[SI5351_MS_REGS];
+    bool ms_int = true;
+    if (output >= 6) {
+        if (si5351_encode_integer(si5351, freq, 0, si5351->vco_freq[pll], &buf[0], &buf[1]) != 0) {
+            return -1;
+        }
+    } else if (si5351_encode_output(si5351, freq, 0, si5351->vco_freq[pll], 0, buf, &ms_int) != 0) {
+        return -1;
+    }
+    si5351->freq[output] = freq;
+    si5351->freq_frac[output] = 0;
+
+    if ((output >= 6) && !si5351_shadow_valid(si5351, SI5351_REG_CLK6_7_R_DIV)) {
+        // The other output's half of the shared R divider register isn't known - work it all out
+        si5351->changed |= SI5351_CHANGED_CONFIG;
+    } else {
+        memcpy(si5351->staged_reg[output], buf, SI5351_MS_REGS);
+        si5351->staged |= (1 << output);
+        si5351->staged_int = (si5351->staged_int & ~(1 << output)) | (ms_int ? (1 << output) : 0);
+        si5351->changed |= SI5351_CHANGED_RETUNE;
+    }
+
+    // During a batch it's sent by si5351_write_batch()
+    return si5351_configure(si5351);
+}
+
+int si5351_retune(si5351_t *si5351, uint8_t output, uint32_t freq)
+{
+    LOCK();
+    int ret = si5351_retune_locked(si5351, output, freq);
+    UNLOCK();
+    return ret;
+}
+
+/*
+ * Precompute a table of output multisynth settings so that hopping between channels needs
+ * no arithmetic at all.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - the output which will hop
+ * - the VCO frequency the table is built for - 0 to use the current VCO frequency of the output's PLL
+ * - a list of channel frequencies
+ * - the number of channels
+ * - a caller-supplied table with room for that many entries
+ * The output must not be the master for its PLL, so the VCO stays where it is while hopping.
+ */
+
+static int si5351_hop_build_locked(si5351_t *si5351, uint8_t output, uint32_t vco_freq, const uint32_t *freqs, size_t count, si5351_hop_t *table)
+{
+    if (!si5351_output_valid(si5351, output)) {
+        LOGE("Clock output out of range");
+        return -1;
+    }
+
+    if (output >= 6) {
+        LOGE("Clock %d has an integer-only divider", output);
+        return -1;
+    }
+
+    si5351_PLL_t pll = (si5351_PLL_t) si5351->clk[output].pll;
+    if (si5351->freq[output] == 0) {
+        LOGE("Clock %d is not running", output);
+        return -1;
+    }
+    if (si5351_is_master(si5351, output)) {
+        LOGE("Clock %d is master for PLL %d", output, pll);
+        return -1;
+    }
+    if (vco_freq == 0) {
+        vco_freq = si5351->vco_freq[pll];
+    }
+    if ((vco_freq < SI5351_VCO_MIN) || (vco_freq > SI5351_VCO_MAX)) {
+        LOGE("VCO frequency %lu out of range", vco_freq);
+        return -1;
+    }
+
+    for (size_t i=0; i<count; i++) {
+        bool ms_int;
+        table[i].freq = freqs[i];
+        table[i].vco_freq = vco_freq;
+        if (si5351_encode_output(si5351, freqs[i], 0, vco_freq, 0, table[i].reg, &ms_int) != 0) {
+            return -1;
+        }
+        table[i].control = si5351_control(si5351, output, si5351->fb_int, ms_int, true);
+    }
+
+    return (0);
+}
+
+int si5351_hop_build(si5351_t *si5351, uint8_t output, uint32_t vco_freq, const uint32_t *freqs, size_t count, si5351_hop_t *table)
+{
+    LOCK();
+    int ret = si5351_hop_build_locked(si5351, output, vco_freq, freqs, count, table);
+    UNLOCK();
+    return ret;
+}
+
+// Hop an output to a channel from a table built by si5351_hop_build().  This is a single
+// write of the precomputed multisynth registers - the output must already be running, from
+// the VCO frequency the table was built for.  The control register is only written if the
+// channel switches the multisynth in or out of integer mode.  A hop is always written straight
+// away, so it's refused between si5351_start_batch() and si5351_write_batch().
+static int si5351_hop_locked(si5351_t *si5351, uint8_t output, const si5351_hop_t *table, size_t index)
+{
+    if (!si5351_output_valid(si5351, output) || (output >= 6)) {
+        LOGE("Clock output out of range");
+        return -1;
+    }
+    if (!si5351->config) {
+        LOGE("Can't hop during a batch");
+        return -1;
+    }
+    if (si5351->pending != NULL) {
+        LOGE("Transfer in progress");
+        return -1;
+    }
+
+    const si5351_hop_t *hop = &table[index];
+    if (si5351->freq[output] == 0) {
+        LOGE("Clock %d is not running", output);
+        return -1;
+    }
+    if (si5351->vco_freq[si5351->clk[output].pll] != hop->vco_freq) {
+        LOGE("VCO has changed since the hop table was built");
+        return -1;
+    }
+
+    si5351->freq[output] = hop->freq;
+    si5351->freq_frac[output] = 0;
+    si5351->staged &= ~(1 << output);
+    si5351->ms_int = (si5351->ms_int & ~(1 << output)) | ((hop->control & 0x40) ? (1 << output) : 0);
+    int ret = si5351_write_reg(si5351, NULL, SI5351_REG_CLK0_CONTROL + output, hop->control);
+    if (si5351_write_regs(si5351, NULL, SI5351_REG_CLK_SYNTH_BASE + (output * 8), hop->reg, SI5351_MS_REGS) != 0) {
+        ret = -1;
+    }
+    if (ret != 0) {
+        si5351->changed |= SI5351_CHANGED_CONFIG;
+    }
+
+    return ret;
+}
+
+int si5351_hop(si5351_t *si5351, uint8_t output, const si5351_hop_t *table, size_t index)
+{
+    LOCK();
+    int ret = si5351_hop_locked(si5351, output, table, index);
+    UNLOCK();
+    return ret;
+}
+
+/*
+ * Set up a frequency sweep on an output.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - the sweep to set up
+ * - the output to sweep
+ * - the start and stop frequencies - the sweep runs downwards if stop is below start
+ * - the step between points
+ * - how long to stay on each point, in microseconds, for si5351_sweep_run()
+ * The output must be running and must not be the master for its PLL.  The VCO stays where
+ * it is for the whole sweep, so each point only changes the output multisynth.  The divider
+ * fractions all share one denominator rather than each being the best possible, so from one
+ * point to the next only the numerator and the low bits of the integer part move, and only
+ * those registers are rewritten.  The cost is the rounding of the fraction to 1/1048575: an
+ * error of up to 0.5 / (1048575 * d) for a divider d, which is about 60ppb at the smallest
+ * divider of 8, falling to under 1ppb at the top of the range.
+ */
+
+int si5351_sweep_init(si5351_t *si5351, si5351_sweep_t *sweep, uint8_t output, uint32_t start, uint32_t stop, uint32_t step, uint32_t dwell_us)
+{
+    if (!si5351_output_valid(si5351, output)) {
+        LOGE("Clock output out of range");
+        return -1;
+    }
+    if (output >= 6) {
+        LOGE("Clock %d has an integer-only divider", output);
+        return -1;
+    }
+    if (step == 0) {
+        LOGE("Sweep step must not be 0");
+        return -1;
+    }
+
+    LOCK();
+    si5351_PLL_t pll = (si5351_PLL_t) si5351->clk[output].pll;
+    uint32_t vco_freq = (pll < SI5351_PLLS) ? si5351->vco_freq[pll] : 0;
+    bool master = si5351_is_master(si5351, output);
+    UNLOCK();
+    if ((vco_freq == 0) || master) {
+        LOGE("Clock %d can't be swept", output);
+        return -1;
+    }
+
+    // Check the ends of the sweep can be reached from this VCO
+    uint8_t buf[SI5351_MS_REGS];
+    bool ms_int;
+    if ((si5351_encode_output(si5351, start, 0, vco_freq, SI5351_SWEEP_DEN, buf, &ms_int) != 0) ||
+        (si5351_encode_output(si5351, stop, 0, vco_freq, SI5351_SWEEP_DEN, buf, &ms_int) != 0)) {
+        return -1;
+    }
+
+    sweep->output = output;
+    sweep->vco_freq = vco_freq;
+    sweep->freq = start;
+    sweep->stop = stop;
+    sweep->step = step;
+    sweep->dwell_us = dwell_us;
+    sweep->done = false;
+    return (0);
+}
+
+// Take the next frequency from a sweep.  Returns false once the sweep is finished.
+static bool si5351_sweep_next(si5351_sweep_t *sweep, uint32_t *freq)
+{
+    if (sweep->done) {
+        return false;
+    }
+    *freq = sweep->freq;
+    if (sweep->stop >= sweep->freq) {
+        if (sweep->stop - sweep->freq < sweep->step) sweep->done = true;
+        else sweep->freq += sweep->step;
+    } else {
+        if (sweep->freq - sweep->stop < sweep->step) sweep->done = true;
+        else sweep->freq -= sweep->step;
+    }
+    return true;
+}
+
+// Move a sweep on to its next point.  Returns 1 if a point was written, 0 if the sweep has
+// finished and -1 on an error, including the output's VCO having moved since the sweep was set
+// up.  Points are always written straight away, so stepping is refused during a batch.
+static int si5351_sweep_step_locked(si5351_t *si5351, si5351_sweep_t *sweep)
+{
+    if (!si5351->config) {
+        LOGE("Can't step a sweep during a batch");
+        return -1;
+    }
+    if (si5351->pending != NULL) {
+        LOGE("Transfer in progress");
+        return -1;
+    }
+    if (si5351->vco_freq[si5351->clk[sweep->output].pll] != sweep->vco_freq) {
+        LOGE("VCO has changed under sweep");
+        return -1;
+    }
+    uint32_t freq;
+    if (!si5351_sweep_next(sweep, &freq)) {
+        return 0;
+    }
+
+    uint8_t output = sweep->output;
+    uint8_t buf[SI5351_MS_REGS];
+    bool ms_int;
+    if (si5351_encode_output(si5351, freq, 0, sweep->vco_freq, SI5351_SWEEP_DEN, buf, &ms_int) != 0) {
+        return -1;
+    }
+    si5351_regmap_t image;
+    memset(&image, 0, sizeof(si5351_regmap_t));
+    si5351_image_block(&image, SI5351_REG_CLK_SYNTH_BASE + (output * 8), buf);
+    si5351_image_set(&image, SI5351_REG_CLK0_CONTROL + output, si5351_control(si5351, output, si5351->fb_int, ms_int, true));
+    int ret = si5351_write_dirty(si5351, NULL, &image);
+
+    si5351->freq[output] = freq;
+    si5351->freq_frac[output] = 0;
+    si5351->staged &= ~(1 << output);
+    if (output < 6) {
+        si5351->ms_int = (si5351->ms_int & ~(1 << output)) | (ms_int ? (1 << output) : 0);
+    }
+    if (ret != 0) {
+        si5351->changed |= SI5351_CHANGED_CONFIG;
+        return -1;
+    }
+    return 1;
+}
+
+int si5351_sweep_step(si5351_t *si5351, si5351_sweep_t *sweep)
+{
+    LOCK();
+    int ret = si5351_sweep_step_locked(si5351, sweep);
+    UNLOCK();
+    return ret;
+}
+
+// Run a whole sweep, waiting dwell_us after each point with the wait function, as for
+// si5351_wait_lock()
+int si5351_sweep_run(si5351_t *si5351, si5351_sweep_t *sweep, int (*wait)(void *dev, uint32_t us))
+{
+    int ret;
+    while ((ret = si5351_sweep_step(si5351, sweep)) == 1) {
+        wait(si5351->dev, sweep->dwell_us);
+    }
+    return ret;
+}
+
+// Precompute the next points of a sweep into a hop table, for a timer to play out with
+// si5351_hop() without doing any arithmetic.  The table can be used as a ring buffer,
+// refilled while the timer works through it.  Returns the number of entries filled, which is
+// less than count at the end of the sweep, or -1 on an error.
+int si5351_sweep_fill(si5351_t *si5351, si5351_sweep_t *sweep, si5351_hop_t *table, size_t count)
+{
+    LOCK();
+    uint8_t fb_int = si5351->fb_int;
+    UNLOCK();
+
+    size_t filled = 0;
+    uint32_t freq;
+    while ((filled < count) && si5351_sweep_next(sweep, &freq)) {
+        bool ms_int;
+        si5351_hop_t *hop = &table[filled];
+        hop->freq = freq;
+        hop->vco_freq = sweep->vco_freq;
+        if (si5351_encode_output(si5351, freq, 0, sweep->vco_freq, SI5351_SWEEP_DEN, hop->reg, &ms_int) != 0) {
+            return -1;
+        }
+        hop->control = si5351_control(si5351, sweep->output, fb_int, ms_int, true);
+        filled++;
+    }
+
+    return (int) filled;
+}
+
+/*
+ * Run a PLL from a fixed VCO frequency rather than deriving it from a master output.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - the PLL
+ * - the VCO frequency, in the range 600-900MHz, or 0 to go back to using the PLL's master output
+ */
+
+static int si5351_set_vco_locked(si5351_t *si5351, si5351_PLL_t pll, uint32_t vco_freq)
+{
+    if (pll >= SI5351_PLLS) {
+        LOGE("PLL %d out of range", pll);
+        return -1;
+    }
+    if ((vco_freq != 0) && ((vco_freq < SI5351_VCO_MIN) || (vco_freq > SI5351_VCO_MAX))) {
+        LOGE("VCO frequency %lu out of range", vco_freq);
+        return -1;
+    }
+
+    si5351->vco_fixed[pll] = vco_freq;
+    si5351->changed |= SI5351_CHANGED_CONFIG;
+    return (si5351_configure(si5351));
+}
+
+int si5351_set_vco(si5351_t *si5351, si5351_PLL_t pll, uint32_t vco_freq)
+{
+    LOCK();
+    int ret = si5351_set_vco_locked(si5351, pll, vco_freq);
+    UNLOCK();
+    return ret;
+}
+
+// How well an output's pre-R frequency can be derived from a VCO frequency (0 if none) - -1 if
+// it can't be, else as si5351_ratio_score()
+static int si5351_plan_score(uint32_t vco_freq, uint32_t scaled, int output)
+{
+    if (vco_freq == 0) {
+        return -1;
+    }
+    if (output >= 6) {
+        // CLK6 and CLK7 can only take an even integer divider
+        return (si5351_int_divider(vco_freq, scaled) != 0) ? 2 : -1;
+    }
+    return ((vco_freq / 8) < scaled) ? -1 : si5351_ratio_score(vco_freq, scaled);
+}
+
+// How much better a candidate VCO frequency is than the one we already have (0 if none) for a
+// set of pre-R output frequencies.  An output which can't be derived from a VCO scores -1,
+// fractional 0, odd integer 1 and even integer 2, as does the crystal ratio.  Fractional
+// dividers are accurate to around a part in 10^12 so there's nothing to choose between them.
+static int si5351_plan_gain(const si5351_t *si5351, uint32_t vco_freq, uint32_t other, const uint32_t *scaled)
+{
+    int gain = 0;
+    for (int i=0; i<SI5351_CLOCKS; i++) {
+        if (scaled[i] == 0) continue;
+        int score = si5351_plan_score(vco_freq, scaled[i], i);
+        int current = si5351_plan_score(other, scaled[i], i);
+        if (score > current) gain += score - current;
+    }
+
+    // The feedback divider only matters if the PLL is going to be used for something
+    if (gain > 0) {
+        gain += si5351_crystal_score(si5351, vco_freq);
+    }
+    return gain;
+}
+
+// Search the candidate VCO frequencies - even multiples of each output and multiples of the
+// crystal, which are the only places an integer divider can turn up - for the best gain
+static uint32_t si5351_plan_search(const si5351_t *si5351, uint32_t other, const uint32_t *scaled)
+{
+    uint32_t best = 0;
+    int best_gain = -1;
+    int max_gain = 2;
+    for (int i=0; i<SI5351_CLOCKS; i++) {
+        if (scaled[i] != 0) max_gain += 3;
+    }
+
+    for (int i=-1; i<SI5351_CLOCKS; i++) {
+        uint32_t step = (i < 0) ? si5351->desc->crystal_freq : scaled[i] * 2;
+        if (step == 0) continue;
+        for (uint32_t vco_freq = ((SI5351_VCO_MIN + step - 1) / step) * step; vco_freq <= SI5351_VCO_MAX; vco_freq += step) {
+            int gain = si5351_plan_gain(si5351, vco_freq, other, scaled);
+            if ((gain > best_gain) || ((gain == best_gain) && (vco_freq < best))) {
+                best = vco_freq;
+                best_gain = gain;
+                // Can't do better than every divider being an even integer
+                if (best_gain == max_gain) return best;
+            }
+        }
+    }
+
+    return best;
+}
+
+/*
+ * Plan the PLLs for a whole set of output frequencies at once.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - a frequency for each of the SI5351_CLOCKS outputs, 0 for outputs which are not used
+ * VCO frequencies for PLL A and PLL B are chosen together to put as many multisynths as
+ * possible into integer mode, then each output is assigned to whichever PLL suits it best.
+ * The VCO frequencies are fixed as if by si5351_set_vco().  Phase, inversion, drive and
+ * disable state are left as they were.
+ */
+
+static int si5351_plan_locked(si5351_t *si5351, const uint32_t *freq)
+{
+    uint32_t scaled[SI5351_CLOCKS];
+    for (int i=0; i<SI5351_CLOCKS; i++) {
+        scaled[i] = 0;
+        if (freq[i] == 0) continue;
+        if (!si5351_output_valid(si5351, i)) {
+            LOGE("Clock %d not present", i);
+            return -1;
+        }
+        if ((freq[i] < SI5351_MIN_FREQ) || (freq[i] > SI5351_MAX_FREQ)) {
+            LOGE("Frequency %lu out of range", freq[i]);
+            return -1;
+        }
+        uint8_t r_div;
+        scaled[i] = (i >= 6) ? si5351_r_scale_int(freq[i], SI5351_VCO_MAX, &r_div) : si5351_r_scale(freq[i], &r_div);
+    }
+
+    // Best single VCO, the best partner for it, then see if the first can be improved given the second
+    uint32_t vco[SI5351_PLLS];
+    vco[SI5351_PLL_A] = si5351_plan_search(si5351, 0, scaled);
+    vco[SI5351_PLL_B] = si5351_plan_search(si5351, vco[SI5351_PLL_A], scaled);
+    vco[SI5351_PLL_A] = si5351_plan_search(si5351, vco[SI5351_PLL_B], scaled);
+
+    si5351_PLL_t pll[SI5351_CLOCKS];
+    for (int i=0; i<SI5351_CLOCKS; i++) {
+        pll[i] = SI5351_PLL_A;
+        if (scaled[i] == 0) continue;
+        int score[SI5351_PLLS];
+        for (int j=0; j<SI5351_PLLS; j++) {
+            score[j] = si5351_plan_score(vco[j], scaled[i], i);
+        }
+        if (score[SI5351_PLL_B] > score[SI5351_PLL_A]) pll[i] = SI5351_PLL_B;
+        if (score[pll[i]] < 0) {
+            LOGE("No VCO frequency available for %lu", freq[i]);
+            return -1;
+        }
+        LOGD("Clock %d on PLL %d, %s divider", i, pll[i], (score[pll[i]] > 0) ? "integer" : "fractional");
+    }
+
+    for (int i=0; i<SI5351_CLOCKS; i++) {
+        si5351->freq[i] = freq[i];
+        si5351->freq_frac[i] = 0;
+        si5351->clk[i].pll = pll[i];
+    }
+    for (int j=0; j<SI5351_PLLS; j++) {
+        si5351->vco_fixed[j] = vco[j];
+        LOGD("PLL %d VCO %lu", j, vco[j]);
+    }
+    si5351->changed |= SI5351_CHANGED_CONFIG;
+
+    return (si5351_configure(si5351));
+}
+
+int si5351_plan(si5351_t *si5351, const uint32_t *freq)
+{
+    LOCK();
+    int ret = si5351_plan_locked(si5351, freq);
+    UNLOCK();
+    return ret;
+}
+
+// Don't update after each change - useful if we're making a bunch of changes at once.  The
+// lock is held until si5351_write_batch(), so another task can't see or interleave with a
+// half-made set of changes.
+void si5351_start_batch(si5351_t *si5351)
+{
+    LOCK();
+    si5351->config = 0;
+}   
+
+// Update the Si5351 with everything changed since si5351_start_batch().  Only the registers
+// which differ from what the chip holds are written, and if only drive strengths and disable
+// states have changed the PLLs and multisynths aren't even recalculated.
+int si5351_write_batch(si5351_t *si5351)
+{
+    si5351->config = 1;
+    int ret = si5351_configure(si5351);
+    UNLOCK();
+    return ret;
+}
+
+// FNV-1a hash of the registers in an image and their values
+static uint32_t si5351_image_signature(const si5351_regmap_t *image)
+{
+    uint32_t hash = 2166136261u;
+    for (int reg=0; reg<SI5351_REGISTERS; reg++) {
+        if (!si5351_image_used(image, reg)) continue;
+        hash = (hash ^ reg) * 16777619u;
+        hash = (hash ^ image->reg[reg]) * 16777619u;
+    }
+    return hash;
+}
+
+// Work out a signature of the register image for the current configuration, for
+// si5351_warm_boot() to check against after a processor reset.  Store it somewhere which
+// doesn't survive the Si5351 losing power.
+int si5351_signature(const si5351_t *si5351, uint32_t *signature)
+{
+    si5351_regmap_t map;
+    LOCK();
+    int ret = si5351_compute_locked(si5351, &map);
+    UNLOCK();
+    if (ret != 0) {
+        return -1;
+    }
+    *signature = si5351_image_signature(&map);
+    return (0);
+}
+
+/*
+ * Finish the batch started after si5351_init_warm(), without disturbing the chip if it already
+ * holds the configuration.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - the signature from si5351_signature() saved before the reset, or 0 if there isn't one
+ * If the signature matches the new configuration, the chip is taken to hold it and nothing is
+ * sent.  Otherwise, if there's a read function, the registers the configuration uses are read
+ * back and only those which differ are written.  Failing both, the chip is fully reprogrammed.
+ * Returns 1 if nothing needed writing, 0 if the chip was updated and -1 on an error.
+ */
+
+static int si5351_warm_boot_locked(si5351_t *si5351, uint32_t signature)
+{
+    si5351->config = 1;
+
+    si5351_regmap_t map;
+    if (si5351_compute_locked(si5351, &map) != 0) {
+        return -1;
+    }
+
+    bool trusted = (signature != 0) && (signature == si5351_image_signature(&map));
+    LOGD("Warm boot, signature %s", trusted ? "matches" : "doesn't match");
+    for (int reg=0; reg<SI5351_REGISTERS; reg++) {
+        if (!si5351_image_used(&map, reg)) continue;
+        if (trusted) {
+            si5351_shadow_update(si5351, reg, &map.reg[reg], 1, true);
+        } else if (si5351->desc->read != NULL) {
+            uint8_t val;
+            bool ok = si5351->desc->read(si5351->dev, reg, &val) == 0;
+            si5351_shadow_update(si5351, reg, &val, 1, ok);
+        }
+    }
+
+    bool dirty = false;
+    for (int reg=0; reg<SI5351_REGISTERS; reg++) {
+        if (si5351_dirty(si5351, &map, reg)) dirty = true;
+    }
+    if (si5351_apply_locked(si5351, &map) != 0) {
+        return -1;
+    }
+    si5351->changed = 0;
+
+    return dirty ? 0 : 1;
+}
+
+int si5351_warm_boot(si5351_t *si5351, uint32_t signature)
+{
+    // The lock was taken by si5351_start_batch()
+    int ret = si5351_warm_boot_locked(si5351, signature);
+    UNLOCK();
+    return ret;
+}
+
+// Set up an empty group of devices to be reprogrammed together.  begin and end are called around
+// each si5351_group_write(), so the platform can hold the bus for the whole session - either
+// can be NULL.
+void si5351_group_init(si5351_group_t *group, void *bus, int (*begin)(void *bus), void (*end)(void *bus))
+{
+    memset(group, 0, sizeof(si5351_group_t));
+    group->bus = bus;
+    group->begin = begin;
+    group->end = end;
+}
+
+// Add an initialised device to a group
+int si5351_group_add(si5351_group_t *group, si5351_t *si5351)
+{
+    if (group->count >= SI5351_GROUP_MAX) {
+        LOGE("Group full");
+        return -1;
+    }
+    group->member[group->count++] = si5351;
+    return 0;
+}
+
+// Start a batch on every device in the group, as si5351_start_batch()
+void si5351_group_start(si5351_group_t *group)
+{
+    for (size_t i=0; i<group->count; i++) {
+        si5351_start_batch(group->member[i]);
+    }
+}
+
+/*
+ * Send the changes made since si5351_group_start() to every device in the group.  Pass in:
+ * - a pointer to the group
+ * - whether to hold off the PLL resets and output enables until every device has been written
+ * Every device's configuration is worked out before anything is sent, so if one of them fails
+ * nothing is changed.  The changed registers then go out back-to-back in a single bus session;
+ * with sync_reset the PLL resets are sent together at the end, followed by the output enables,
+ * so that all the devices switch over within a few bytes of each other.  Each device's batch
+ * is ended whether or not the write succeeds.
+ */
+
+int si5351_group_write(si5351_group_t *group, bool sync_reset)
+{
+    si5351_regmap_t map[SI5351_GROUP_MAX];
+    uint8_t pll_reset[SI5351_GROUP_MAX];
+    int ret = 0;
+
+    for (size_t i=0; (i<group->count) && (ret == 0); i++) {
+        si5351_t *si5351 = group->member[i];
+        if (si5351->pending != NULL) {
+            LOGE("Transfer in progress");
+            ret = -1;
+        } else if (si5351_compute_locked(si5351, &map[i]) != 0) {
+            ret = -1;
+        }
+    }
+
+    if ((ret == 0) && (group->begin != NULL) && (group->begin(group->bus) != 0)) {
+        ret = -1;
+    }
+    if (ret == 0) {
+        for (size_t i=0; i<group->count; i++) {
+            si5351_adopt(group->member[i], &map[i]);
+            int sent = si5351_send_regs(group->member[i], NULL, &map[i], &pll_reset[i]);
+            if (!sync_reset && (si5351_send_finish(group->member[i], NULL, &map[i], pll_reset[i]) != 0)) {
+                sent = -1;
+            }
+            // A device which didn't take everything is put right by its next configure
+            group->member[i]->changed = (sent == 0) ? 0 : SI5351_CHANGED_CONFIG;
+            if (sent != 0) ret = -1;
+        }
+        if (sync_reset) {
+            for (size_t i=0; i<group->count; i++) {
+                if ((pll_reset[i] != 0) && (si5351_write_regs(group->member[i], NULL, SI5351_REG_PLL_RESET, &pll_reset[i], 1) != 0)) {
+                    group->member[i]->reset_pll |= pll_reset[i];
+                    group->member[i]->changed = SI5351_CHANGED_CONFIG;
+                    ret = -1;
+                }
+            }
+            for (size_t i=0; i<group->count; i++) {
+                if (si5351_send_finish(group->member[i], NULL, &map[i], 0) != 0) {
+                    group->member[i]->changed = SI5351_CHANGED_CONFIG;
+                    ret = -1;
+                }
+            }
+        }
+        if (group->end != NULL) {
+            group->end(group->bus);
+        }
+    }
+
+    // End the batches started by si5351_group_start()
+    for (size_t i=0; i<group->count; i++) {
+        si5351_t *si5351 = group->member[i];
+        si5351->config = 1;
+        UNLOCK();
+    }
+
+    return ret;
+}
+
+// Called by the platform when a transaction list handed to submit() has gone out
+static void si5351_async_done(void *ctx, int status)
+{
+    si5351_t *si5351 = (si5351_t *) ctx;
+    si5351_txlist_t *list = si5351->pending;
+    si5351_done_t done = si5351->pending_done;
+    void *arg = si5351->pending_arg;
+
+    if (status != 0) {
+        LOGE("Transfer failed %d", status);
+        STATS_ADD(write_errors, 1);
+        si5351_txlist_invalidate(si5351, list);
+        si5351->changed |= SI5351_CHANGED_CONFIG;
+    }
+    si5351->pending = NULL;
+    if (done != NULL) {
+        done(si5351, status, arg);
+    }
+}
+
+/*
+ * Update the Si5351 with the new configuration without waiting for the bus.  Call this
+ * instead of si5351_write_batch(), after si5351_start_batch() and the changes.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - a caller-owned transaction list, which must stay valid until done is called
+ * - a function called once the transfer has completed, with its status - can be NULL
+ * - a pointer passed to done
+ * The register writes are built into the list and handed to the submit function set with
+ * si5351_set_submit(), so the platform can send them by DMA or from another task.  Only one
+ * transfer can be in flight at a time; the next configuration can be computed meanwhile.
+ */
+
+// Compute the new configuration and build the register writes which get the chip there into
+// a transaction list, as if they had been sent.  Ends the batch.
+static int si5351_build_list(si5351_t *si5351, si5351_txlist_t *list)
+{
+    if (si5351->pending != NULL) {
+        LOGE("Transfer already in progress");
+        return -1;
+    }
+
+    list->count = 0;
+    list->used = 0;
+    list->overflow = false;
+
+    // As si5351_configure() - only a change to the PLLs or the outputs' settings needs the
+    // whole image, and the outputs gating off
+    si5351_regmap_t map;
+    if ((si5351->changed & SI5351_CHANGED_CONFIG) || (si5351->changed == 0)) {
+        if (si5351_compute_locked(si5351, &map) != 0) {
+            return -1;
+        }
+        si5351_adopt(si5351, &map);
+        if (si5351_send(si5351, list, &map) != 0) {
+            return -1;
+        }
+    } else {
+        si5351_compute_controls(si5351, &map);
+        si5351_write_dirty(si5351, list, &map);
+        if (list->overflow) {
+            LOGE("Transaction list full");
+            si5351_txlist_invalidate(si5351, list);
+            return -1;
+        }
+        si5351->ms_int = map.ms_int;
+        si5351->staged = 0;
+    }
+    si5351->config = 1;
+    si5351->changed = 0;
+    return 0;
+}
+
+static int si5351_write_batch_async_locked(si5351_t *si5351, si5351_txlist_t *list, si5351_done_t done, void *arg)
+{
+    if (si5351->desc->submit == NULL) {
+        LOGE("No submit function");
+        return -1;
+    }
+    if (si5351_build_list(si5351, list) != 0) {
+        return -1;
+    }
+
+    if (list->count == 0) {
+        // Nothing to send
+        if (done != NULL) {
+            done(si5351, 0, arg);
+        }
+        return 0;
+    }
+
+    si5351->pending = list;
+    si5351->pending_done = done;
+    si5351->pending_arg = arg;
+    if (si5351->desc->submit(si5351->dev, list->tx, list->count, si5351_async_done, si5351) != 0) {
+        LOGE("Submit failed");
+        si5351->pending = NULL;
+        si5351_txlist_invalidate(si5351, list);
+        return -1;
+    }
+
+    return 0;
+}
+
+int si5351_write_batch_async(si5351_t *si5351, si5351_txlist_t *list, si5351_done_t done, void *arg)
+{
+    // Ends the batch, and releases the lock taken by si5351_start_batch()
+    si5351->config = 1;
+    int ret = si5351_write_batch_async_locked(si5351, list, done, arg);
+    UNLOCK();
+    return ret;
+}
+
+/*
+ * Get a change ready to go out at a precise moment, such as a symbol boundary.  Call this
+ * instead of si5351_write_batch(), after si5351_start_batch() and the changes.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - a caller-owned transaction list, which must stay valid until done is called
+ * - a function called once the change has been sent, with its status - can be NULL
+ * - a pointer passed to done
+ * All the arithmetic happens here: the register writes which differ from what the chip holds
+ * are built into the list, and nothing is sent until si5351_fire().  Until then the change
+ * counts as a transfer in progress, so other changes are refused.  A batch of si5351_retune()
+ * calls comes down to the retuned outputs' multisynth registers alone, with nothing gated
+ * off; changes which need the whole configuration working out send what si5351_write_batch()
+ * would.
+ */
+
+static int si5351_schedule_locked(si5351_t *si5351, si5351_txlist_t *list, si5351_done_t done, void *arg)
+{
+    if (si5351_build_list(si5351, list) != 0) {
+        return -1;
+    }
+
+    // Armed even if there's nothing to send, so si5351_fire() always completes it
+    si5351->pending = list;
+    si5351->pending_done = done;
+    si5351->pending_arg = arg;
+    __atomic_store_n(&si5351->armed, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int si5351_schedule(si5351_t *si5351, si5351_txlist_t *list, si5351_done_t done, void *arg)
+{
+    // Ends the batch, and releases the lock taken by si5351_start_batch()
+    si5351->config = 1;
+    int ret = si5351_schedule_locked(si5351, list, done, arg);
+    UNLOCK();
+    return ret;
+}
+
+// Send the change prepared by si5351_schedule() - call this from the platform's timer interrupt
+// or highest priority task at the deadline.  It takes no lock and does no arithmetic: it hands
+// the list to the submit function if there is one, otherwise writes each run with a single
+// bus transaction and no retries, so the time it takes is just the bus time.  Returns -1 if
+// nothing was scheduled or the transfer failed.  The change is claimed with an atomic exchange,
+// so it's sent exactly once even if si5351_unschedule() is running at the same moment.
+int si5351_fire(si5351_t *si5351)
+{
+    if (!__atomic_exchange_n(&si5351->armed, false, __ATOMIC_ACQ_REL)) {
+        return -1;
+    }
+    si5351_txlist_t *list = si5351->pending;
+
+    if ((si5351->desc->submit != NULL) && (list->count != 0)) {
+        if (si5351->desc->submit(si5351->dev, list->tx, list->count, si5351_async_done, si5351) != 0) {
+            si5351_async_done(si5351, -1);
+            return -1;
+        }
+        return 0;
+    }
+
+    // Already counted in the stats when the list was built
+    int status = 0;
+    for (size_t i=0; i<list->count; i++) {
+        const si5351_tx_t *tx = &list->tx[i];
+        if ((tx->len > 1) && (si5351->desc->write_block != NULL)) {
+            if (si5351->desc->write_block(si5351->dev, tx->reg, tx->data, tx->len) != 0) status = -1;
+        } else {
+            for (size_t j=0; j<tx->len; j++) {
+                if (si5351->desc->write(si5351->dev, tx->reg + j, tx->data[j]) != 0) status = -1;
+            }
+        }
+    }
+    si5351_async_done(si5351, status);
+    return status;
+}
+
+// Drop the change prepared by si5351_schedule() without sending it.  The driver keeps the new
+// settings, and the next configure writes whatever the chip is missing.
+void si5351_unschedule(si5351_t *si5351)
+{
+    LOCK();
+    // Whichever of this and si5351_fire() claims the change first has it
+    if (__atomic_exchange_n(&si5351->armed, false, __ATOMIC_ACQ_REL)) {
+        si5351_txlist_invalidate(si5351, si5351->pending);
+        si5351->pending = NULL;
+        si5351->changed |= SI5351_CHANGED_CONFIG;
+    }
+    UNLOCK();
+}
+
+/*
+ * Set the state of an output while it's disabled.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - the output, or SI5351_CLOCK_ALL
+ * - low, high, high impedance or never disabled
+ */
+
+static int si5351_set_disabled_locked(si5351_t *si5351, int clock, si5351_disable_t ds)
+{
+    if (ds > SI5351_DISABLE_NEVER) {
+        LOGE("Disable state %d invalid", ds);
+        return -1;
+    }
+    if (clock == SI5351_CLOCK_ALL) {
+        for (int i=0; i<SI5351_CLOCKS; i++) {
+            si5351->clk[i].disable = ds;
+        }
+    } else {
+        if (si5351_output_valid(si5351, clock)) {
+            si5351->clk[clock].disable = ds;
+        } else {
+            LOGE("Clock %d invalid", clock);
+            return -1;
+        }
+    }
+    si5351->changed |= SI5351_CHANGED_CONTROL;
+    return (si5351_configure(si5351));
+}
+
+int si5351_set_disabled(si5351_t *si5351, int clock, si5351_disable_t ds)
+{
+    LOCK();
+    int ret = si5351_set_disabled_locked(si5351, clock, ds);
+    UNLOCK();
+    return ret;
+}
+
+/*
+ * Set the drive strength of an output.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - the output, or SI5351_CLOCK_ALL
+ * - the drive current, 2 to 8mA
+ */
+
+static int si5351_set_drive_locked(si5351_t *si5351, int clock, si5351_clock_drive_t drive)
+{
+    if (drive > SI5351_CLK_DRV_8MA) {
+        LOGE("Drive %d invalid", drive);
+        return -1;
+    }
+    if (clock == SI5351_CLOCK_ALL) {
+        for (int i=0; i<SI5351_CLOCKS; i++) {
+            si5351->clk[i].drive = drive;
+        }
+    } else {
+        if (si5351_output_valid(si5351, clock)) {
+            si5351->clk[clock].drive = drive;
+        } else {
+            LOGE("Clock %d invalid", clock);
+            return -1;
+        }
+    }
+    si5351->changed |= SI5351_CHANGED_CONTROL;
+    return (si5351_configure(si5351));
+}
+
+int si5351_set_drive(si5351_t *si5351, int clock, si5351_clock_drive_t drive)
+{
+    LOCK();
+    int ret = si5351_set_drive_locked(si5351, clock, drive);
+    UNLOCK();
+    return ret;
+}
+
+// Rewrite just the feedback multisynths and spread spectrum registers for the current VCO
+// frequencies, after something which only affects them has changed.  The CLK6 and CLK7
+// control registers carry the feedback integer mode bits, so they're rewritten if those move.
+static int si5351_update_feedback(si5351_t *si5351)
+{
+    if (!si5351->config || (si5351->changed & SI5351_CHANGED_CONFIG)) {
+        // Picked up by the next full configure
+        si5351->changed |= SI5351_CHANGED_CONFIG;
+        return 0;
+    }
+    if (si5351->pending != NULL) {
+        LOGE("Transfer in progress");
+        return -1;
+    }
+
+    si5351_regmap_t image;
+    memset(&image, 0, sizeof(si5351_regmap_t));
+    image.fb_int = si5351->fb_int;
+    for (int i=0; i<SI5351_PLLS; i++) {
+        if (si5351->vco_freq[i] != 0) {
+            si5351_compute_feedback(si5351, i, si5351->vco_freq[i], &image);
+        }
+    }
+    if (si5351->vco_freq[SI5351_PLL_A] != 0) {
+        si5351_compute_spread(si5351, &image);
+    }
+    if (image.fb_int != si5351->fb_int) {
+        for (int i=6; i<si5351_outputs(si5351); i++) {
+            si5351_image_set(&image, SI5351_REG_CLK0_CONTROL + i, 
+                si5351_control(si5351, i, image.fb_int, (si5351->ms_int & (1 << i)) != 0, si5351->freq[i] != 0));
+        }
+    }
+    si5351->fb_int = image.fb_int;
+    if (si5351_write_dirty(si5351, NULL, &image) != 0) {
+        si5351->changed |= SI5351_CHANGED_CONFIG;
+        return -1;
+    }
+
+    return (0);
+}
+
+/*
+ * Correct for the measured frequency of the crystal.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - how far the crystal is from its nominal frequency, in parts per billion - positive if it's fast
+ * The correction goes into the PLL feedback multisynths, so every output on each PLL moves
+ * together and only the MSNx registers (and, the first time a feedback divider goes
+ * fractional, the CLK6/CLK7 control registers) are rewritten.  The PLLs aren't reset, so
+ * small steps such as temperature drift updates don't glitch the outputs.
+ */
+
+static int si5351_set_correction_locked(si5351_t *si5351, int32_t ppb)
+{
+    if ((ppb > SI5351_CORRECTION_MAX) || (ppb < -SI5351_CORRECTION_MAX)) {
+        LOGE("Correction %ld out of range", ppb);
+        return -1;
+    }
+
+    si5351->crystal_ppb = ppb;
+    return (si5351_update_feedback(si5351));
+}
+
+int si5351_set_correction(si5351_t *si5351, int32_t ppb)
+{
+    LOCK();
+    int ret = si5351_set_correction_locked(si5351, ppb);
+    UNLOCK();
+    return ret;
+}
+
+/*
+ * Spread the PLL A VCO frequency to cut EMI.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - down spread, which only ever lowers the frequency, or center spread, either side of it
+ * - the amount of spread in units of 0.01% - 0.1% to 2.5% down or 0.1% to 1.5% center - or 0 for off
+ * Every output on PLL A is spread.  The spread parameters follow the PLL A feedback divider,
+ * so they're recalculated along with it, but changing the spread on its own only rewrites the
+ * spread registers - plus CLK6's control register if PLL A's feedback divider was in integer
+ * mode, which spread spectrum doesn't allow.
+ */
+
+static int si5351_set_spread_locked(si5351_t *si5351, si5351_spread_t mode, uint16_t amount)
+{
+    uint16_t max = (mode == SI5351_SPREAD_CENTER) ? SI5351_SPREAD_CENTER_MAX : SI5351_SPREAD_DOWN_MAX;
+    if ((mode > SI5351_SPREAD_CENTER) || ((amount != 0) && ((amount < SI5351_SPREAD_MIN) || (amount > max)))) {
+        LOGE("Spread %d out of range", amount);
+        return -1;
+    }
+
+    si5351->spread = amount;
+    si5351->spread_center = (mode == SI5351_SPREAD_CENTER);
+    return (si5351_update_feedback(si5351));
+}
+
+int si5351_set_spread(si5351_t *si5351, si5351_spread_t mode, uint16_t amount)
+{
+    LOCK();
+    int ret = si5351_set_spread_locked(si5351, mode, amount);
+    UNLOCK();
+    return ret;
+}
+
+// Parts per billion out from a requested frequency, saturating at the limits of an int32_t
+static int32_t si5351_error_ppb(uint64_t actual_q, uint64_t requested_q)
+{
+    if (requested_q == 0) {
+        return 0;
+    }
+    int64_t diff = (int64_t) (actual_q - requested_q);
+    if ((diff > ((int64_t) 1 << 33)) || (diff < -((int64_t) 1 << 33))) {
+        return (diff > 0) ? INT32_MAX : INT32_MIN;
+    }
+    int64_t ppb = (diff * 1000000000) / (int64_t) requested_q;
+    if (ppb > INT32_MAX) return INT32_MAX;
+    if (ppb < INT32_MIN) return INT32_MIN;
+    return (int32_t) ppb;
+}
+
+/*
+ * Find out what an output is really running at.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - the output
+ * - where to put the achieved frequency, in Hz * 2^SI5351_FREQ_SHIFT - can be NULL
+ * - where to put its error from the requested frequency in parts per billion - can be NULL
+ * This is worked out exactly from the divider values the chip was last sent, rather than
+ * from what was asked for, so a control loop can correct for the rounding of the dividers.
+ * Returns -1 if the output isn't running or the driver doesn't know what the chip holds.
+ */
+
+int si5351_get_freq(const si5351_t *si5351, uint8_t output, uint64_t *actual_q, int32_t *error_ppb)
+{
+    if (!si5351_output_valid(si5351, output)) {
+        LOGE("Clock output out of range");
+        return -1;
+    }
+
+    LOCK();
+    uint8_t ctrl = SI5351_REG_CLK0_CONTROL + output;
+    uint8_t fb = SI5351_REG_MSN_PLL_BASE + ((si5351->shadow[ctrl] & 0x20) ? 8 : 0);
+    uint8_t ms = SI5351_REG_CLK_SYNTH_BASE + (output * 8);
+    bool valid = si5351_shadow_valid(si5351, ctrl);
+    for (int i=0; i<SI5351_MS_REGS; i++) {
+        valid = valid && si5351_shadow_valid(si5351, fb + i);
+        if (output < 6) valid = valid && si5351_shadow_valid(si5351, ms + i);
+    }
+    if (output >= 6) {
+        valid = valid && si5351_shadow_valid(si5351, SI5351_REG_MS6_P1 + (output - 6)) && 
+            si5351_shadow_valid(si5351, SI5351_REG_CLK6_7_R_DIV);
+    }
+    uint64_t actual = valid ? si5351_decode_freq(si5351, si5351->shadow, output) : 0;
+    uint64_t requested = ((uint64_t) si5351->freq[output] << SI5351_FREQ_SHIFT) | si5351->freq_frac[output];
+    UNLOCK();
+
+    if (actual == 0) {
+        return -1;
+    }
+    if (actual_q != NULL) *actual_q = actual;
+    if (error_ppb != NULL) *error_ppb = si5351_error_ppb(actual, requested);
+    return (0);
+}
+
+// Report which multisynths the last configuration put into integer mode - a bit per PLL for
+// the feedback multisynths and a bit per output
+void si5351_get_integer_mode(const si5351_t *si5351, uint8_t *fb_int, uint8_t *ms_int)
+{
+    *fb_int = si5351->fb_int;
+    *ms_int = si5351->ms_int;
+}
+
+// In glitch-free mode, reconfiguring only disables the outputs which are actually affected by
+// the change, rather than every output
+void si5351_set_glitch_free(si5351_t *si5351, bool glitch_free)
+{
+    si5351->glitch_free = glitch_free;
+}
+
+#ifndef SI5351_CONST_DESC
+// Use an auto-incrementing block write for runs of registers.  The per-register write
+// function passed to si5351_init() is still used for single registers and if this is NULL.
+void si5351_set_write_block(si5351_t *si5351, int (*write_block)(void *dev, uint8_t reg, const uint8_t *buf, size_t len))
+{
+    si5351_own_desc(si5351)->write_block = write_block;
+}
+#endif
+
+/*
+ * Program the chip from a prebuilt register image, such as one generated at compile time
+ * by si5351.hpp.  The image is a list of records, each a register address, a count and
+ * that many register values, which are streamed out in order.
+ */
+
+static int si5351_load_image_locked(si5351_t *si5351, const uint8_t *image, size_t len)
+{
+    if (si5351->pending != NULL) {
+        LOGE("Transfer in progress");
+        return -1;
+    }
+    int ret = 0;
+    size_t i = 0;
+    while (i + 2 <= len) {
+        uint8_t reg = image[i];
+        uint8_t count = image[i + 1];
+        if ((i + 2 + count > len) || (reg + count > SI5351_REGISTERS)) {
+            LOGE("Image record at %d invalid", i);
+            return -1;
+        }
+        if (si5351_write_regs(si5351, NULL, reg, &image[i + 2], count) != 0) {
+            ret = -1;
+        }
+        i += 2 + count;
+    }
+
+    return ret;
+}
+
+int si5351_load_image(si5351_t *si5351, const uint8_t *image, size_t len)
+{
+    LOCK();
+    int ret = si5351_load_image_locked(si5351, image, len);
+    UNLOCK();
+    return ret;
+}
+
+#ifndef SI5351_CONST_DESC
+// Set the function used to read registers back from the chip
+void si5351_set_read(si5351_t *si5351, int (*read)(void *dev, uint8_t reg, uint8_t *val))
+{
+    si5351_own_desc(si5351)->read = read;
+}
+#endif
+
+// Read the device status register - SYS_INIT, LOL_B, LOL_A and LOS bits
+static int si5351_read_status_locked(si5351_t *si5351, uint8_t *status)
+{
+    if (si5351->desc->read == NULL) {
+        LOGE("No read function");
+        return -1;
+    }
+    return (si5351->desc->read(si5351->dev, SI5351_REGISTER_0_DEVICE_STATUS, status) == 0) ? 0 : -1;
+}
+
+int si5351_read_status(si5351_t *si5351, uint8_t *status)
+{
+    LOCK();
+    int ret = si5351_read_status_locked(si5351, status);
+    UNLOCK();
+    return ret;
+}
+
+// Choose which status bits may assert the interrupt pin - a set bit masks that source off
+static int si5351_set_interrupt_mask_locked(si5351_t *si5351, uint8_t mask)
+{
+    if (si5351->pending != NULL) {
+        LOGE("Transfer in progress");
+        return -1;
+    }
+    return si5351_write_reg(si5351, NULL, SI5351_REGISTER_2_INTERRUPT_STATUS_MASK, mask);
+}
+
+int si5351_set_interrupt_mask(si5351_t *si5351, uint8_t mask)
+{
+    LOCK();
+    int ret = si5351_set_interrupt_mask_locked(si5351, mask);
+    UNLOCK();
+    return ret;
+}
+
+/*
+ * Wait for the chip to finish initialising and for PLLs to lock.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - the PLLs to wait for, as a bit per PLL - (1 << SI5351_PLL_A) | (1 << SI5351_PLL_B)
+ * - how long to wait, in microseconds
+ * - a function which waits for up to the given time.  This can simply be a delay, or if the
+ *   interrupt pin is wired up and unmasked it can return as soon as the pin asserts.
+ * Returns 0 as soon as the status register shows lock, or -1 on a timeout or read failure.
+ */
+
+int si5351_wait_lock(si5351_t *si5351, uint8_t plls, uint32_t timeout_us, int (*wait)(void *dev, uint32_t us))
+{
+    uint8_t mask = SI5351_STATUS_SYS_INIT;
+    if (plls & (1 << SI5351_PLL_A)) mask |= SI5351_STATUS_LOL_A;
+    if (plls & (1 << SI5351_PLL_B)) mask |= SI5351_STATUS_LOL_B;
+
+    while (1) {
+        uint8_t status;
+        if (si5351_read_status(si5351, &status) != 0) {
+            return -1;
+        }
+        if ((status & mask) == 0) {
+            return 0;
+        }
+        if (timeout_us == 0) {
+            LOGE("PLL lock timeout, status %02x", status);
+            return -1;
+        }
+
+        // Time spent waiting is counted in full poll intervals, so we never overrun the timeout
+        uint32_t us = (timeout_us < SI5351_LOCK_POLL_US) ? timeout_us : SI5351_LOCK_POLL_US;
+        wait(si5351->dev, us);
+        timeout_us -= us;
+    }
+}
+
+#ifndef SI5351_CONST_DESC
+// Set the function used by si5351_write_batch_async() to hand a list of register runs to the
+// platform.  It must call complete(ctx, status) once they have all been sent.
+void si5351_set_submit(si5351_t *si5351, si5351_submit_t submit)
+{
+    si5351_own_desc(si5351)->submit = submit;
+}
+#endif
+
+/*
+ * Make the driver safe to call from more than one task.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - a function to take the lock, and one to release it - NULL for no locking
+ * - a pointer passed to both, usually the mutex
+ * The lock is held across every call which changes the driver state or uses the bus, and from
+ * si5351_start_batch() through to whichever of si5351_write_batch(), si5351_write_batch_async()
+ * or si5351_schedule() ends the batch, so it must be recursive - a FreeRTOS
+ * recursive mutex, for example.  si5351_fire() and the completion callbacks of
+ * si5351_write_batch_async() and si5351_schedule() run without it.
+ */
+
+void si5351_set_lock(si5351_t *si5351, void (*lock)(void *arg), void (*unlock)(void *arg), void *arg)
+{
+    si5351->lock = lock;
+    si5351->unlock = unlock;
+    si5351->lock_arg = arg;
+}
+
+// Set up an empty multisynth cache
+void si5351_cache_init(si5351_cache_t *cache)
+{
+    memset(cache, 0, sizeof(si5351_cache_t));
+}
+
+/*
+ * Keep recent multisynth solutions, so that configurations and channels which come round
+ * again skip the fraction search.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - a cache set up with si5351_cache_init(), or NULL to stop using one
+ * The cache holds the last SI5351_CACHE_LEN feedback and output solutions, and counts its
+ * hits and misses.  It depends only on the two frequencies, so devices can share one if they
+ * also share a lock.
+ */
+
+void si5351_set_cache(si5351_t *si5351, si5351_cache_t *cache)
+{
+    LOCK();
+    si5351->cache = cache;
+    UNLOCK();
+}
+
+/*
+ * Set how hard to try when a write to the chip fails.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - how many more attempts to make at each failed write - 0 to give up straight away
+ * A failed block write is retried in pieces of SI5351_MS_REGS registers, so a NAK costs a
+ * multisynth's worth of bytes rather than the whole run.  Whatever still fails is reported
+ * with -1 from the call which made the change; the driver remembers that it doesn't know
+ * what those registers hold, and the next configure - any other change, or just
+ * si5351_start_batch() and si5351_write_batch() - writes only those registers again.
+ */
+
+void si5351_set_retries(si5351_t *si5351, uint8_t retries)
+{
+    LOCK();
+    si5351->retries = retries;
+    UNLOCK();
+}
+
+/*
+ * Count what the driver does, for telemetry.  Pass in:
+ * - a pointer to the si5351_t struct
+ * - the counters, which the caller clears and reads as it likes, or NULL to stop counting
+ * If the event hook in the counters is set, it's called at the start and end of each register
+ * image computation and each send to the chip, so the caller can timestamp them.
+ */
+
+void si5351_set_stats(si5351_t *si5351, si5351_stats_t *stats)
+{
+    LOCK();
+    si5351->stats = stats;
+    UNLOCK();
+}
+
+// Queue a retune for si5351_process_queue() to send.  This never blocks and takes no lock, so
+// it can be called from a high priority task while the bus is busy - but only from one task at
+// a time.  Returns -1 if the queue is full.
+int si5351_post_retune(si5351_t *si5351, uint8_t output, uint32_t freq)
+{
+    uint8_t tail = si5351->queue_tail;
+    uint8_t head = __atomic_load_n(&si5351->queue_head, __ATOMIC_ACQUIRE);
+    if ((uint8_t) (tail - head) >= SI5351_QUEUE_LEN) {
+        return -1;
+    }
+
+    si5351_cmd_t *cmd = &si5351->queue[tail & (SI5351_QUEUE_LEN - 1)];
+    cmd->output = output;
+    cmd->freq = freq;
+    __atomic_store_n(&si5351->queue_tail, (uint8_t) (tail + 1), __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Send the retunes queued by si5351_post_retune(), from the task which owns the bus.  If an
+// output has been retuned more than once only the latest frequency is written.  Returns the
+// number of retunes sent, or -1 if any of them failed.
+int si5351_process_queue(si5351_t *si5351)
+{
+    uint8_t head = si5351->queue_head;
+    uint8_t tail = __atomic_load_n(&si5351->queue_tail, __ATOMIC_ACQUIRE);
+    int sent = 0;
+    bool failed = false;
+
+    for (uint8_t i=head; i!=tail; i++) {
+        const si5351_cmd_t *cmd = &si5351->queue[i & (SI5351_QUEUE_LEN - 1)];
+        bool superseded = false;
+        for (uint8_t j=i+1; j!=tail; j++) {
+            if (si5351->queue[j & (SI5351_QUEUE_LEN - 1)].output == cmd->output) superseded = true;
+        }
+        if (superseded) continue;
+
+        if (si5351_retune(si5351, cmd->output, cmd->freq) != 0) {
+            failed = true;
+        } else {
+            sent++;
+        }
+    }
+
+    // Only now hand the entries back, so the producer can't overwrite one we're reading
+    __atomic_store_n(&si5351->queue_head, tail, __ATOMIC_RELEASE);
+    return failed ? -1 : sent;
 }
@@ -0,0 +1,204 @@
+/*
+ * SI5351 driver tests - nothing reaches the bus while a change is in flight.
+ *
+ * Copyright (c) David Knell 2024.
+ * Licensed under the CC-BY-NC 4.0 license - text at https://creativecommons.org/licenses/by-nc/4.0/legalcode.en
+ * For all enquiries, please contact the author at david.knell@gmail.com
+ *
+ * Each test arms a change with si5351_schedule(), tries one of the calls which write to the
+ * chip directly, and checks that it was refused without a bus transaction.  Once the change
+ * has been fired, the driver's shadow of the registers has to match the mock chip.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "si5351.h"
+
+// The mock chip, and how many transactions have gone to it
+static uint8_t chip[256];
+static unsigned long transactions;
+static int failures;
+
+#define CHECK(cond) do { if (!(cond)) { printf("  %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+static int test_write(void *dev, uint8_t reg, uint8_t val)
+{
+    (void) dev;
+    chip[reg] = val;
+    transactions++;
+    return 0;
+}
+
+static int test_write_block(void *dev, uint8_t reg, const uint8_t *buf, size_t len)
+{
+    (void) dev;
+    memcpy(&chip[reg], buf, len);
+    transactions++;
+    return 0;
+}
+
+// CLK0 is the master for PLL A at 10MHz and CLK1 runs from it at 7.1MHz
+static void test_setup(si5351_t *si5351)
+{
+    memset(chip, 0, sizeof(chip));
+    si5351_init(si5351, NULL, SI5351_CRYSTAL_FREQ_25MHZ, SI5351_CRYSTAL_LOAD_10PF, SI5351_VARIANT_A_20, test_write, NULL);
+    si5351_set_write_block(si5351, test_write_block);
+    si5351_set_glitch_free(si5351, true);
+    si5351_start_batch(si5351);
+    si5351_set(si5351, 0, SI5351_PLL_A, 10000000, 0, false, true);
+    si5351_set(si5351, 1, SI5351_PLL_A, 7100000, 0, false, false);
+    si5351_write_batch(si5351);
+}
+
+// Schedule a retune of CLK1 - nothing is sent until si5351_fire()
+static void test_arm(si5351_t *si5351, si5351_txlist_t *list, uint32_t freq)
+{
+    si5351_start_batch(si5351);
+    si5351_set(si5351, 1, SI5351_PLL_A, freq, 0, false, false);
+    CHECK(si5351_schedule(si5351, list, NULL, NULL) == 0);
+}
+
+// Every register the driver thinks it knows has to hold that value on the chip
+static bool test_shadow_matches(const si5351_t *si5351)
+{
+    for (int reg=0; reg<SI5351_REGISTERS; reg++) {
+        if ((si5351->shadow_valid[reg >> 3] & (1 << (reg & 7))) && (si5351->shadow[reg] != chip[reg])) {
+            printf("  register %d: shadow %02x chip %02x\n", reg, si5351->shadow[reg], chip[reg]);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_fire(si5351_t *si5351)
+{
+    CHECK(si5351_fire(si5351) == 0);
+    CHECK(test_shadow_matches(si5351));
+}
+
+static void test_retune(void)
+{
+    si5351_t si5351;
+    si5351_txlist_t list;
+    test_setup(&si5351);
+    test_arm(&si5351, &list, 7100100);
+
+    transactions = 0;
+    CHECK(si5351_retune(&si5351, 1, 7100200) == -1);
+    CHECK(transactions == 0);
+    test_fire(&si5351);
+    CHECK(si5351_retune(&si5351, 1, 7100200) == 0);
+    CHECK(test_shadow_matches(&si5351));
+}
+
+static void test_hop(void)
+{
+    si5351_t si5351;
+    si5351_txlist_t list;
+    si5351_hop_t table[2];
+    const uint32_t freqs[2] = { 7000000, 7200000 };
+    test_setup(&si5351);
+    CHECK(si5351_hop_build(&si5351, 1, 0, freqs, 2, table) == 0);
+    test_arm(&si5351, &list, 7100100);
+
+    transactions = 0;
+    CHECK(si5351_hop(&si5351, 1, table, 0) == -1);
+    CHECK(transactions == 0);
+    test_fire(&si5351);
+    CHECK(si5351_hop(&si5351, 1, table, 0) == 0);
+    CHECK(test_shadow_matches(&si5351));
+}
+
+static void test_sweep_step(void)
+{
+    si5351_t si5351;
+    si5351_txlist_t list;
+    si5351_sweep_t sweep;
+    test_setup(&si5351);
+    CHECK(si5351_sweep_init(&si5351, &sweep, 1, 7000000, 7001000, 100, 0) == 0);
+    test_arm(&si5351, &list, 7100100);
+
+    transactions = 0;
+    CHECK(si5351_sweep_step(&si5351, &sweep) == -1);
+    CHECK(transactions == 0);
+    test_fire(&si5351);
+    CHECK(si5351_sweep_step(&si5351, &sweep) == 1);
+    CHECK(test_shadow_matches(&si5351));
+}
+
+static void test_load_image(void)
+{
+    si5351_t si5351;
+    si5351_txlist_t list;
+    const uint8_t image[] = { SI5351_REG_CLK0_CONTROL + 2, 1, 0x80 };
+    test_setup(&si5351);
+    test_arm(&si5351, &list, 7100100);
+
+    transactions = 0;
+    CHECK(si5351_load_image(&si5351, image, sizeof(image)) == -1);
+    CHECK(transactions == 0);
+    test_fire(&si5351);
+    CHECK(si5351_load_image(&si5351, image, sizeof(image)) == 0);
+    CHECK(test_shadow_matches(&si5351));
+}
+
+static void test_set_interrupt_mask(void)
+{
+    si5351_t si5351;
+    si5351_txlist_t list;
+    test_setup(&si5351);
+    test_arm(&si5351, &list, 7100100);
+
+    transactions = 0;
+    CHECK(si5351_set_interrupt_mask(&si5351, 0xF0) == -1);
+    CHECK(transactions == 0);
+    test_fire(&si5351);
+    CHECK(si5351_set_interrupt_mask(&si5351, 0xF0) == 0);
+    CHECK(test_shadow_matches(&si5351));
+}
+
+// A batch of retunes is armed as just the retuned output's multisynth registers, with the
+// outputs left running - in either mode
+static void test_schedule_retune(void)
+{
+    for (int glitch_free=0; glitch_free<2; glitch_free++) {
+        si5351_t si5351;
+        si5351_txlist_t list;
+        test_setup(&si5351);
+        si5351_set_glitch_free(&si5351, glitch_free);
+
+        si5351_start_batch(&si5351);
+        CHECK(si5351_retune(&si5351, 1, 7100100) == 0);
+        CHECK(si5351_schedule(&si5351, &list, NULL, NULL) == 0);
+        CHECK(list.count != 0);
+        for (size_t i=0; i<list.count; i++) {
+            CHECK(list.tx[i].reg >= SI5351_REG_CLK_SYNTH_BASE + 8);
+            CHECK(list.tx[i].reg + list.tx[i].len <= SI5351_REG_CLK_SYNTH_BASE + 16);
+        }
+        test_fire(&si5351);
+    }
+}
+
+int main(void)
+{
+    static const struct {
+        const char *name;
+        void (*run)(void);
+    } tests[] = {
+        { "retune", test_retune },
+        { "hop", test_hop },
+        { "sweep_step", test_sweep_step },
+        { "load_image", test_load_image },
+        { "set_interrupt_mask", test_set_interrupt_mask },
+        { "schedule_retune", test_schedule_retune },
+    };
+
+    for (size_t i=0; i<sizeof(tests) / sizeof(tests[0]); i++) {
+        int before = failures;
+        tests[i].run();
+        printf("%-20s %s\n", tests[i].name, (failures == before) ? "ok" : "FAILED");
+    }
+
+    return (failures == 0) ? 0 : 1;
+}
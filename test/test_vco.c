@@ -0,0 +1,156 @@
+/*
+ * SI5351 driver tests - a PLL stays where it is unless its master output needs it to move.
+ *
+ * Copyright (c) David Knell 2024.
+ * Licensed under the CC-BY-NC 4.0 license - text at https://creativecommons.org/licenses/by-nc/4.0/legalcode.en
+ * For all enquiries, please contact the author at david.knell@gmail.com
+ *
+ * Moving a VCO means rewriting its feedback multisynth and resetting the PLL, which glitches
+ * every output on it.  Each test makes a change which shouldn't need that, and checks that
+ * nothing went to PLL A's feedback registers and no PLL A reset was sent.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "si5351.h"
+
+// Which registers have been written to the mock chip, and the PLL reset bits sent
+static bool written[256];
+static uint8_t resets;
+static int failures;
+
+#define CHECK(cond) do { if (!(cond)) { printf("  %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+static int test_write(void *dev, uint8_t reg, uint8_t val)
+{
+    (void) dev;
+    written[reg] = true;
+    if (reg == SI5351_REG_PLL_RESET) resets |= val;
+    return 0;
+}
+
+static int test_write_block(void *dev, uint8_t reg, const uint8_t *buf, size_t len)
+{
+    for (size_t i=0; i<len; i++) {
+        test_write(dev, reg + i, buf[i]);
+    }
+    return 0;
+}
+
+// CLK0 is the master for PLL A at 10MHz and CLK1 runs from it at 7.1MHz
+static void test_setup(si5351_t *si5351, bool glitch_free)
+{
+    si5351_init(si5351, NULL, SI5351_CRYSTAL_FREQ_25MHZ, SI5351_CRYSTAL_LOAD_10PF, SI5351_VARIANT_A_20, test_write, NULL);
+    si5351_set_write_block(si5351, test_write_block);
+    si5351_set_glitch_free(si5351, glitch_free);
+    si5351_start_batch(si5351);
+    si5351_set(si5351, 0, SI5351_PLL_A, 10000000, 0, false, true);
+    si5351_set(si5351, 1, SI5351_PLL_A, 7100000, 0, false, false);
+    si5351_write_batch(si5351);
+    memset(written, 0, sizeof(written));
+    resets = 0;
+}
+
+static bool test_msna_written(void)
+{
+    for (int reg=SI5351_REG_MSN_PLL_BASE; reg<SI5351_REG_MSN_PLL_BASE + SI5351_MS_REGS; reg++) {
+        if (written[reg]) return true;
+    }
+    return false;
+}
+
+// A retune of CLK1 followed by an unrelated change on the other PLL
+static void test_retune_then_set(void)
+{
+    si5351_t si5351;
+    test_setup(&si5351, true);
+    uint32_t vco_freq = si5351.vco_freq[SI5351_PLL_A];
+
+    CHECK(si5351_retune(&si5351, 1, 7200000) == 0);
+    CHECK(si5351_set(&si5351, 2, SI5351_PLL_B, 14400000, 0, false, true) == 0);
+    CHECK(si5351.vco_freq[SI5351_PLL_A] == vco_freq);
+    CHECK(!test_msna_written());
+    CHECK((resets & SI5351_PLL_RESET_A) == 0);
+}
+
+// A retune of CLK1 followed by a new output on the same PLL
+static void test_retune_then_add(void)
+{
+    si5351_t si5351;
+    test_setup(&si5351, true);
+    uint32_t vco_freq = si5351.vco_freq[SI5351_PLL_A];
+
+    CHECK(si5351_retune(&si5351, 1, 7200000) == 0);
+    CHECK(si5351_set(&si5351, 2, SI5351_PLL_A, 14400000, 0, false, false) == 0);
+    CHECK(si5351.vco_freq[SI5351_PLL_A] == vco_freq);
+    CHECK(!test_msna_written());
+    CHECK(!written[SI5351_REG_PLL_RESET]);
+}
+
+// A retune of CLK1 made during a batch goes out as just its multisynth, without the outputs
+// being gated off, in either mode
+static void test_batch_retune(void)
+{
+    for (int glitch_free=0; glitch_free<2; glitch_free++) {
+        si5351_t si5351;
+        test_setup(&si5351, glitch_free);
+
+        si5351_start_batch(&si5351);
+        CHECK(si5351_retune(&si5351, 1, 7200000) == 0);
+        CHECK(si5351_write_batch(&si5351) == 0);
+        for (int reg=0; reg<SI5351_REGISTERS; reg++) {
+            bool ms1 = (reg >= SI5351_REG_CLK_SYNTH_BASE + 8) && (reg < SI5351_REG_CLK_SYNTH_BASE + 16);
+            if (written[reg] && !ms1) printf("  register %d written\n", reg);
+            CHECK(!written[reg] || ms1);
+        }
+    }
+}
+
+// A crystal trim moves the feedback multisynth but not the VCO, then or later
+static void test_correction(void)
+{
+    si5351_t si5351;
+    test_setup(&si5351, true);
+    uint32_t vco_freq = si5351.vco_freq[SI5351_PLL_A];
+
+    CHECK(si5351_set_correction(&si5351, 100) == 0);
+    CHECK(si5351.vco_freq[SI5351_PLL_A] == vco_freq);
+    memset(written, 0, sizeof(written));
+    resets = 0;
+    CHECK(si5351_set(&si5351, 2, SI5351_PLL_B, 14400000, 0, false, true) == 0);
+    CHECK(si5351.vco_freq[SI5351_PLL_A] == vco_freq);
+    CHECK(!test_msna_written());
+    CHECK((resets & SI5351_PLL_RESET_A) == 0);
+
+    // Calibrated before the first configure, the same VCO is chosen
+    si5351_t trimmed;
+    si5351_init(&trimmed, NULL, SI5351_CRYSTAL_FREQ_25MHZ, SI5351_CRYSTAL_LOAD_10PF, SI5351_VARIANT_A_20, test_write, NULL);
+    si5351_start_batch(&trimmed);
+    si5351_set_correction(&trimmed, 100);
+    si5351_set(&trimmed, 0, SI5351_PLL_A, 10000000, 0, false, true);
+    si5351_set(&trimmed, 1, SI5351_PLL_A, 7100000, 0, false, false);
+    CHECK(si5351_write_batch(&trimmed) == 0);
+    CHECK(trimmed.vco_freq[SI5351_PLL_A] == vco_freq);
+}
+
+int main(void)
+{
+    static const struct {
+        const char *name;
+        void (*run)(void);
+    } tests[] = {
+        { "retune_then_set", test_retune_then_set },
+        { "retune_then_add", test_retune_then_add },
+        { "batch_retune", test_batch_retune },
+        { "correction", test_correction },
+    };
+
+    for (size_t i=0; i<sizeof(tests) / sizeof(tests[0]); i++) {
+        int before = failures;
+        tests[i].run();
+        printf("%-20s %s\n", tests[i].name, (failures == before) ? "ok" : "FAILED");
+    }
+
+    return (failures == 0) ? 0 : 1;
+}